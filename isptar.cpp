@@ -5,28 +5,49 @@
 #include <map>
 #include <string>
 #include <fcntl.h>
-#include <fnmatch.h>
 #include <iostream>
 #include <memory>
+#include <set>
+#include <deque>
+#include <atomic>
+#include <algorithm>
 #include "isptar_misc.h"
 #include "isptar_tar.h"
 #include "isptar_file.h"
 #include "isptar_gzip.h"
+#include "isptar_codec.h"
 #include "isptar_args.h"
 #include "isptar_slice.h"
+#include "isptar_thread.h"
+#include "isptar_listing.h"
+#include "isptar_walk.h"
+#include "isptar_prefetch.h"
+#include "isptar_rules.h"
 #include <string.h>
 #include <stdexcept>
 
 #define	PART_NAME_PREFIX	".partname."
 #define	PART_DEST_PREFIX	"."
 #define	EXCLUDE				"--exclude-compression "
+#define	SAMPLE_SIZE			(64 * 1024)
+#define	SAMPLE_MIN_SIZE		512
+#define	SAMPLE_STORE_RATIO	0.95
+#define	SAMPLE_FAST_RATIO	0.75
+#define	DICT_SIZE			(32 * 1024)
+#define	DICT_SAMPLE_SIZE	1024
+#define	DICT_FILE_SIZE		(128 * 1024)
+#define	DICT_NAME			".backup.dictionary"
+#define	BATCH_FILES			256
+#define	BATCH_SIZE			(16 * 1024 * 1024)
+#define	PARALLEL_OPEN_FILES	256
+#define	LISTING_INDEX_STEP	1024
 
 class TarReader;
 
 class Copy : public io::OStream {
 public:
 	Copy(io::OStream &first, io::OStream &second) : m_first(first), m_second(second) {}
-	void Write(const char *buf, int size) {
+	void Write(const char *buf, int64_t size) {
 		m_first.Write(buf, size);
 		m_second.Write(buf, size);
 	}
@@ -39,8 +60,8 @@ class LIStream : public io::IStream {
 public:
 	LIStream(io::IStream &in, int64_t limit = 0) : m_in(in), m_limit(limit) {}
 	void Reset(int64_t limit) { m_limit = limit; }
-	int Read(char *buf, int size) {
-		int res = m_in.Read(buf, std::min(m_limit, (int64_t)size));
+	int64_t Read(char *buf, int64_t size) {
+		int64_t res = m_in.Read(buf, std::min(m_limit, size));
 		if (res > 0)
 			m_limit -= res;
 		return res;
@@ -50,15 +71,79 @@ private:
 	int64_t m_limit;
 };
 
+class StrOStream : public io::OStream {
+public:
+	StrOStream(std::string &str) : m_str(str) {}
+	void Write(const char *buf, int64_t size) { m_str.append(buf, size); }
+private:
+	std::string &m_str;
+};
+
+class StrIStream : public io::IStream {
+public:
+	StrIStream(const std::string &str) : m_str(str), m_pos(0) {}
+	int64_t Read(char *buf, int64_t size) {
+		int64_t res = std::min((size_t)size, m_str.size() - m_pos);
+		memcpy(buf, m_str.data() + m_pos, res);
+		m_pos += res;
+		return res;
+	}
+private:
+	const std::string &m_str;
+	std::string::size_type m_pos;
+};
+
+/**
+ * Позволяет заглянуть в начало потока, не теряя прочитанные данные
+ */
+class PeekIStream : public io::IStream {
+public:
+	PeekIStream(io::IStream &in) : m_in(in), m_pos(0) {}
+	const std::string & Peek(int size) {
+		char buf[CHUNK];
+		while ((int)m_buf.size() < size) {
+			int res = m_in.Read(buf, std::min(size - (int)m_buf.size(), (int)sizeof(buf)));
+			if (res <= 0)
+				break;
+			m_buf.append(buf, res);
+		}
+		return m_buf;
+	}
+	int64_t Read(char *buf, int64_t size) {
+		if (m_pos < m_buf.size()) {
+			int64_t res = std::min((size_t)size, m_buf.size() - m_pos);
+			memcpy(buf, m_buf.data() + m_pos, res);
+			m_pos += res;
+			return res;
+		}
+		return m_in.Read(buf, size);
+	}
+private:
+	io::IStream &m_in;
+	std::string m_buf;
+	std::string::size_type m_pos;
+};
+
+/// значение атрибута name из хвоста строки листинга ("\tname=value")
+static std::string GetAttr(const std::string &line, const std::string &name) {
+	auto pos = line.find('\t' + name + '=');
+	if (pos == std::string::npos)
+		return "";
+	pos += name.size() + 2;
+	return line.substr(pos, line.find('\t', pos) - pos);
+}
+
 class Sender {
 public:
-	Sender() : m_source(0) {}
+	Sender() : m_source(0), m_peek(0), m_source_end(false) {}
 	virtual ~Sender() {}
 	virtual bool SendInfo(const tar::FileInfo &info) {
 		std::cout << info.Str() << std::endl;
 		return false;
 	}
 	virtual void SendData(io::IStream &in) {}
+	/// уровень сжатия следующего файла из правил, -1 - уровень архива
+	virtual void SetRuleLevel(int) {}
 
 	void SetSource(TarReader *reader, bool reference) {
 		m_source = reader;
@@ -70,14 +155,35 @@ protected:
 		bool found;
 		std::string file_offs;
 		io::IStream *file_data;
+		/// атрибут s= файла в базе, для file_data
+		std::string file_extents;
 		PrevInfo() : found(false), file_data(NULL) {}
 	};
 
 	PrevInfo GetPrevInfo(const tar::FileInfo &info);
 
+public:
+	/**
+	 * Придется ли читать данные файла с диска (нет, если в базе он такой же).
+	 * Можно спрашивать заранее, до SendInfo, но в том же порядке файлов
+	 */
+	bool NeedData(const tar::FileInfo &info);
+
 private:
+	struct PrevEntry {
+		tar::FileInfo info;
+		std::string offs;
+	};
+
 	TarReader *m_source;
 	bool m_reference;
+	/// прочитанный из m_source, но еще не пройденный SendInfo листинг базы
+	std::deque<PrevEntry> m_prev;
+	/// докуда m_prev просмотрен NeedData
+	size_t m_peek;
+	bool m_source_end;
+
+	const PrevEntry * FindPrev(const std::string &filename, bool drop);
 };
 
 class PipeSender : public Sender {
@@ -132,7 +238,9 @@ void MakeIsolated(io::IStream &in, std::map<std::string, std::string> &head, io:
 		header += ptr->first + '=' + ptr->second + '\n';
 	header += "header_size=";
 	std::string packed_header = gzip::Pack(header);
-	std::string header_size = misc::Str(packed_header.size());
+	std::string footer = gzip::Footer(misc::Int(head["listing_size"]), packed_header);
+	// старые версии читают footer вместе с заголовком и не замечают его
+	std::string header_size = misc::Str(packed_header.size() + footer.size());
 	tar::FileInfo info;
 	info.filename = ".backup.info";
 	info.type = REGTYPE;
@@ -154,6 +262,7 @@ void MakeIsolated(io::IStream &in, std::map<std::string, std::string> &head, io:
 		listing_size -= size;
 	}
 	out.WriteStr(packed_header);
+	out.WriteStr(footer);
 	tar.AddDone(list_real_size + header.size());
 	//std::cout << "Header size: " << header_size << std::endl;
 	tar.WriteData(header_size);
@@ -162,16 +271,38 @@ void MakeIsolated(io::IStream &in, std::map<std::string, std::string> &head, io:
 }
 
 
+struct PackOptions {
+	std::string codec;
+	int level;
+	int threads;
+	bool adaptive;
+	int64_t checkpoint;
+	std::string dictionary;
+	int listing;
+	PackOptions() : codec(DEFAULT_CODEC), level(-1), threads(0), adaptive(false), checkpoint(0), listing(LISTING_TEXT) {}
+};
+
 class TarSender : public Sender {
 public:
-	TarSender(const std::string &name, slice::OStream &out, const std::string &lname)
+	TarSender(const std::string &name, slice::OStream &out, const std::string &lname,
+		const PackOptions &opts = PackOptions())
 		: m_filename(name)
 		, m_out(out)
-		, m_gz_out(m_out)
-		, m_tar(m_gz_out)
+		, m_opts(opts)
+		, m_pack(codec::CreateOStream(opts.codec, m_out, opts.level, opts.threads))
+		, m_tar(*m_pack)
 		, m_listing_name(lname)
 		, m_gz_listing(m_listing)
-		, m_compress(true) {
+		, m_list_writer(m_gz_listing, opts.listing)
+		, m_level(opts.level == -1 ? codec::DefaultLevel(opts.codec) : opts.level)
+		, m_cur_level(m_level)
+		, m_rule_level(-1)
+		, m_member_size(0)
+		, m_dict_training(opts.dictionary == "auto")
+		, m_dict_pending(false)
+		, m_dict_ready(false)
+		, m_dict_offs(new std::string)
+		, m_listing_lines(0) {
 		char path[128];
 		strncpy(path, "/tmp/backup.XXXXXX", sizeof(path));
 		misc::ResHandle fd = mkostemps(path, 0, O_LARGEFILE);
@@ -180,6 +311,25 @@ public:
 		unlink(path);
 		m_listing.Reset(fd);
 		LoadCompressedList("etc/isptar.conf");
+		// кодек без словарей: ни файла словаря, ни ключей заголовка
+		if (!m_pack->SetDictionary(""))
+			m_dict_training = false;
+		else if (!opts.dictionary.empty() && !m_dict_training)
+			LoadDictionary(opts.dictionary);
+	}
+
+	void LoadDictionary(const std::string &filename) {
+		io::FileIStream in(filename);
+		if (!in.fd())
+			throw std::runtime_error("Failed to open dictionary '" + filename + "'");
+		char buf[CHUNK];
+		int size;
+		while ((size = in.Read(buf, sizeof(buf))) > 0)
+			m_dictionary.append(buf, size);
+		// deflate видит только последние DICT_SIZE байт словаря
+		if (m_dictionary.size() > DICT_SIZE)
+			m_dictionary.erase(0, m_dictionary.size() - DICT_SIZE);
+		m_dict_pending = !m_dictionary.empty();
 	}
 
 	void LoadCompressedList(const std::string &filename) {
@@ -195,7 +345,7 @@ public:
 				if (size <= 0) {
 					if (!buffer.empty())
 						if (buffer.size() > sizeof(EXCLUDE) && buffer.compare(0, sizeof(EXCLUDE) - 1, EXCLUDE) == 0)
-							m_compressed.push_back(buffer.substr(sizeof(EXCLUDE) - 1));
+							AddCompressed(buffer.substr(sizeof(EXCLUDE) - 1));
 					return;
 				}
 				auto offs = buffer.size();
@@ -204,21 +354,40 @@ public:
 			}
 			if (pos > 0)
 				if (pos > sizeof(EXCLUDE) && buffer.compare(0, sizeof(EXCLUDE) - 1, EXCLUDE) == 0)
-					m_compressed.push_back(buffer.substr(sizeof(EXCLUDE) - 1, pos - (sizeof(EXCLUDE) - 1)));
+					AddCompressed(buffer.substr(sizeof(EXCLUDE) - 1, pos - (sizeof(EXCLUDE) - 1)));
 			buffer.erase(0, pos + 1);
 		}
 	}
 
+	/// дополнительное поле заголовка архива
+	void SetHeader(const std::string &name, const std::string &value) { m_head[name] = value; }
+
 	void WriteFooter(const std::string &parts = "") {
-		m_gz_out.Flush(true);
-		m_gz_listing.WriteStr("\n");
+		m_pack->Flush(true);
+		m_pack->Sync();
+		m_list_writer.Finish();
 		m_gz_listing.Flush(true);
-		auto list_size = m_listing.Offset();
+		std::map<std::string, std::string> head = m_head;
 		auto list_real_size = m_gz_listing.TotalOut();
-		std::map<std::string, std::string> head;
+		if (!m_listing_index.empty()) {
+			// индекс отдельным member сразу за листингом, старые версии его не читают
+			head["listing_index"] = misc::Str(m_listing.Offset());
+			gzip::OStream index(m_listing);
+			index.WriteStr(m_listing_index);
+			index.Flush(true);
+			list_real_size += index.TotalOut();
+		}
+		auto list_size = m_listing.Offset();
 		head["listing_header"] = "512";
 		head["listing_size"] = misc::Str(list_size);
 		head["listing_real_size"] = misc::Str(list_real_size);
+		head["codec"] = m_opts.codec;
+		if (m_opts.listing != LISTING_TEXT)
+			head["listing_format"] = misc::Str(m_opts.listing);
+		if (m_dict_ready) {
+			head["dictionary"] = *m_dict_offs;
+			head["dictionary_size"] = misc::Str(m_dictionary.size());
+		}
 		if (!parts.empty())
 			head["parts"] = parts;
 		lseek64(m_listing.fd(), 0, SEEK_SET);
@@ -231,97 +400,290 @@ public:
 			MakeIsolated(in, head, m_out);
 	}
 
-	bool IsNeedCompress(const tar::FileInfo &info) {
+	void AddCompressed(const std::string &suffix) {
+		m_compressed[suffix.size()].insert(suffix);
+	}
+
+	bool IsNeedCompress(const std::string &filename) const {
 		ForEachI(m_compressed, it)
-			if (info.filename.size() >= it->size() &&
-				info.filename.compare(info.filename.size() - it->size(), it->size(), *it) == 0)
+			if (filename.size() >= it->first &&
+				it->second.count(filename.substr(filename.size() - it->first)))
 				return false;
 		return true;
 	}
 
-	void SetCompress(bool compress) {
-		if (compress) {
-			if (!m_compress) {
-				m_compress = true;
-				m_gz_out.SetLevel(9, Z_DEFAULT_STRATEGY);
-			}
-		} else {
-			if (m_compress) {
-				m_compress = false;
-				m_gz_out.SetLevel(0, Z_DEFAULT_STRATEGY);
-			}
+	/**
+	 * Пробно сжимаем начало файла быстрым deflate и по степени сжатия
+	 * выбираем: хранить без сжатия, сжимать быстро или сжимать максимально
+	 */
+	int SampleLevel(PeekIStream &in) {
+		const std::string &sample = in.Peek(std::min((int64_t)SAMPLE_SIZE, m_member_size));
+		if (sample.size() < SAMPLE_MIN_SIZE)
+			return m_level;
+		uLongf size = compressBound(sample.size());
+		std::string packed(size, '\0');
+		if (compress2((Bytef *)&packed[0], &size, (const Bytef *)sample.data(), sample.size(), 1) != Z_OK)
+			return m_level;
+		double ratio = (double)size / sample.size();
+		if (ratio >= SAMPLE_STORE_RATIO)
+			return 0;
+		if (ratio >= SAMPLE_FAST_RATIO)
+			return std::min(m_level, codec::FastLevel(m_opts.codec));
+		return m_level;
+	}
+
+	void SetLevel(int level) {
+		if (level != m_cur_level) {
+			m_cur_level = level;
+			m_pack->SetLevel(level);
 		}
 	}
 
+	/**
+	 * Словарь хранится в архиве отдельным файлом DICT_NAME (в листинг не
+	 * попадает), его положение записывается в заголовок
+	 */
+	void WriteDictionary() {
+		m_dict_pending = false;
+		tar::FileInfo info;
+		info.filename = DICT_NAME;
+		info.type = REGTYPE;
+		info.uid = getuid();
+		info.user = info.GetUserName();
+		info.gid = getgid();
+		info.group = info.GetGroupName();
+		info.mode = 0400;
+		info.time = time(NULL);
+		info.size = m_dictionary.size();
+		m_tar.Add(info);
+		m_pack->Flush(true);
+		m_pack->SetDictionary("");
+		auto offs = m_dict_offs;
+		m_pack->Mark([this, offs] {
+			auto fpos = m_out.Offset();
+			*offs = misc::Str(fpos.first) + ':' + misc::Str(fpos.second);
+		});
+		m_tar.WriteData(m_dictionary);
+		m_tar.WriteTail();
+		m_dict_ready = true;
+	}
+
+	/// копим начала первых мелких файлов, пока не наберется словарь
+	void TrainDictionary(PeekIStream &in) {
+		const std::string &sample = in.Peek(std::min((int64_t)DICT_SAMPLE_SIZE, m_member_size));
+		m_dictionary.append(sample, 0, std::min(sample.size(), (std::string::size_type)DICT_SAMPLE_SIZE));
+		if (m_dictionary.size() >= DICT_SIZE) {
+			m_dictionary.resize(DICT_SIZE);
+			m_dict_training = false;
+			m_dict_pending = true;
+		}
+	}
+
+	/// общий словарь нужен только мелким сжимаемым файлам
+	bool UseDictionary(int level) {
+		if (!m_dict_ready)
+			return false;
+		bool use = level && m_member_size <= DICT_FILE_SIZE;
+		return m_pack->SetDictionary(use ? m_dictionary : "") && use;
+	}
+
 	virtual bool SendInfo(const tar::FileInfo &info) {
 		auto prev = GetPrevInfo(info);
-		m_gz_listing.WriteStr(info.Str());
+		std::string line = info.Str();
 		bool save_data = !prev.found || prev.file_data;
 		//std::cerr << info.Str() << (save_data ? " save " : " not save ") << std::endl;
 		if (save_data) {
-			SetCompress(true);
+			SetLevel(m_level);
+			if (m_dict_pending)
+				WriteDictionary();
 			m_tar.Add(info);
 		}
 		if (info.type == REGTYPE) {
 			save_data &= info.size > 0;
 			if (save_data) {
-				SetCompress(IsNeedCompress(info));
-				m_gz_out.Flush(true);
-				auto fpos = m_out.Offset();
-				auto zpos = m_gz_out.Offset();
-				m_gz_listing.WriteStr("\t0:" + misc::Str(fpos.first) + ':' +
-					misc::Str(fpos.second) + ':' + misc::Str(zpos));
+				// member начинается в SendData, когда можно заглянуть в данные
+				m_member = line;
+				m_member_name = info.filename;
+				m_member_size = info.size;
+				line.clear();
 				if (prev.file_data) {
 					// берем файл из архива
-					SendData(*prev.file_data);
+					SendData(*prev.file_data, prev.file_extents);
 					save_data = false;
 				}
 			} else if (!prev.file_offs.empty()) // ссылка на предыдущий архив
-				m_gz_listing.WriteStr('\t' + prev.file_offs);
+				line += '\t' + prev.file_offs;
 		} else
 			save_data = false;
-		m_gz_listing.WriteStr("\n");
+		if (!line.empty())
+			m_pack->Mark([this, line] { WriteListing(line); });
 		return save_data;
 	}
 
+	virtual void SetRuleLevel(int level) { m_rule_level = level; }
+
 	virtual void SendData(io::IStream &in) {
-		m_tar.WriteData(in);
+		auto sparse = dynamic_cast<io::SparseIStream *>(&in);
+		SendData(in, sparse ? io::ExtentsStr(sparse->extents()) : "");
+	}
+
+	/// данные из другого архива: extents - атрибут s= его листинга
+	void SendData(io::IStream &in, const std::string &extents) {
+		PeekIStream data(in);
+		int level = m_rule_level >= 0 ? m_rule_level : IsNeedCompress(m_member_name) ? m_level : 0;
+		if (m_opts.adaptive && level && m_rule_level < 0)
+			level = SampleLevel(data);
+		if (m_dict_training && level && m_member_size <= DICT_FILE_SIZE)
+			TrainDictionary(data);
+		SetLevel(level);
+		m_pack->Flush(true);
+		bool dict = UseDictionary(level);
+		auto zpos = m_pack->Offset();
+		std::string line = m_member;
+		std::string attrs = m_opts.adaptive ? "\tz=" + misc::Str(level) : "";
+		if (dict)
+			attrs += "\td=1";
+		if (!extents.empty())
+			attrs += "\ts=" + extents;
+		// позиция member в m_out известна только после записи предыдущих
+		std::shared_ptr<std::string> offs(new std::string);
+		m_pack->Mark([this, offs, zpos] {
+			auto fpos = m_out.Offset();
+			*offs = misc::Str(fpos.first) + ':' + misc::Str(fpos.second) + ':' + misc::Str(zpos);
+		});
+		m_member.clear();
+		std::shared_ptr<std::string> points(new std::string);
+		WriteData(data, points);
 		m_tar.WriteTail();
+		m_pack->Mark([this, line, offs, attrs, points] {
+			WriteListing(line + "\t0:" + *offs + attrs +
+				(points->empty() ? "" : "\tc=" + *points));
+		});
+	}
+
+	/**
+	 * Вместо SendData: member файла копируется из другого архива как есть
+	 * (copy пишет его в выходной поток и возвращает false, если не может).
+	 * В member только данные файла с выравниванием (TarReader::CopyMember),
+	 * так что архив остается обычным tar.gz. offs - позиция файла в
+	 * исходном листинге, его атрибуты переносятся
+	 */
+	bool SendMember(const std::function<bool(io::OStream &)> &copy, const std::string &offs) {
+		m_pack->Flush(true);
+		m_pack->Sync();
+		auto fpos = m_out.Offset();
+		if (!copy(m_out))
+			return false;
+		m_tar.Skip();
+		auto pos = offs.find('\t');
+		WriteListing(m_member + "\t0:" + misc::Str(fpos.first) + ':' + misc::Str(fpos.second) + ":0" +
+			(pos == std::string::npos ? "" : offs.substr(pos)));
+		m_member.clear();
+		return true;
+	}
+
+	/**
+	 * Каждые LISTING_INDEX_STEP строк листинг начинается с контрольной точки,
+	 * в индекс пишется имя первой записи блока и смещение точки в листинге.
+	 * Листинг отсортирован, поэтому по индексу можно сразу перейти к нужному
+	 * блоку. Первый блок начинается с начала member (смещение 0)
+	 */
+	void WriteListing(const std::string &line) {
+		if (m_listing_lines++ % LISTING_INDEX_STEP == 0) {
+			int64_t pos = m_gz_listing.Checkpoint() ? m_listing.Offset() : 0;
+			if (pos)
+				m_list_writer.Restart();
+			m_listing_index += line.substr(0, line.find('\t')) + '\t' + misc::Str(pos) + '\n';
+		}
+		m_list_writer.Write(line);
+	}
+
+	/**
+	 * Каждые checkpoint байт файла ставим контрольную точку и запоминаем ее
+	 * как "позиция в файле:slice:смещение", чтобы читать файл с середины
+	 */
+	void WriteData(io::IStream &data, std::shared_ptr<std::string> points) {
+		int64_t done = 0;
+		while (m_opts.checkpoint > 0 && m_tar.DataLeft() > m_opts.checkpoint) {
+			auto left = m_tar.DataLeft();
+			LIStream part(data, m_opts.checkpoint);
+			m_tar.WriteData(part);
+			if (left - m_tar.DataLeft() != m_opts.checkpoint || !m_pack->Checkpoint())
+				break;
+			done += m_opts.checkpoint;
+			m_pack->Mark([this, points, done] {
+				auto fpos = m_out.Offset();
+				if (!points->empty())
+					points->push_back(',');
+				points->append(misc::Str(done) + ':' + misc::Str(fpos.first) + ':' + misc::Str(fpos.second));
+			});
+		}
+		m_tar.WriteData(data);
 	}
 private:
 	const std::string m_filename;
 	slice::OStream &m_out;
-	gzip::OStream m_gz_out;
+	const PackOptions m_opts;
+	codec::OStreamPtr m_pack;
 	tar::Writer m_tar;
 	const std::string m_listing_name;
 	io::FileOStream m_listing;
 	gzip::OStream m_gz_listing;
-	std::vector<std::string> m_compressed;
-	bool m_compress;
+	listing::Writer m_list_writer;
+	std::map<std::string::size_type, std::set<std::string> > m_compressed;
+	int m_level;
+	int m_cur_level;
+	int m_rule_level;
+	std::string m_member;
+	std::string m_member_name;
+	int64_t m_member_size;
+	std::string m_dictionary;
+	bool m_dict_training;
+	bool m_dict_pending;
+	bool m_dict_ready;
+	std::shared_ptr<std::string> m_dict_offs;
+	int64_t m_listing_lines;
+	std::string m_listing_index;
+	std::map<std::string, std::string> m_head;
 };
 
 class Reader {
 public:
-	Reader(Sender &send, const args::StringVector &exclude) : m_send(send), m_exclude(exclude) { }
+	Reader(Sender &send, const rules::Matcher &rules) : m_send(send), m_rules(rules), m_walk_threads(0), m_read_window(0) { }
 
+	/**
+	 * С m_read_window файлы не отправляются сразу, а копятся в очереди,
+	 * пока данные тех, что читаются заранее, не займут m_read_window
+	 */
 	void Read(const std::string &_root, const std::string &folder) {
 		std::string root = _root;
 		if (!root.empty() && root[root.size() - 1] != '/')
 			root.push_back('/');
-		file::DirTree dir(root + folder);
-		tar::FileInfo info;
+		// исключенные каталоги, из которых include ничего не вернет, и каталоги под хуком заранее не читаем
+		walk::Walker dir(root + folder, m_walk_threads, [this, &root](const std::string &path) {
+			const std::string name = path.substr(root.size());
+			return (!m_rules.Exclude(name) || m_rules.Descend(name)) && !Hook(name);
+		});
+		if (m_read_window > 0 && !m_prefetch)
+			m_prefetch.reset(new prefetch::Scheduler);
+		std::deque<Item> queue;
+		int64_t queued = 0;
 		misc::Script script(m_hook);
 		while (dir.Read()) {
-			if (dir.type() != file::DirTree::dttDir && dir.IsDir())
-				continue;
 			const std::string filename = dir.RealPath();
 			const std::string arch_filename = filename.substr(root.size());
-			if (Exclude(arch_filename)) {
-				dir.Set(file::DirTree::dtSkip);
+			const rules::Result rule = m_rules.Match(arch_filename);
+			// в исключенный каталог заходим, если include может что-то вернуть
+			// из него: сам каталог сохраняется, остальное исключается по одному
+			if (rule.exclude && !(dir.IsDir() && m_rules.Descend(arch_filename))) {
+				dir.Skip();
 				continue;
 			}
-			bool hook = !m_hook_name.empty() && arch_filename.compare(0, m_hook_name.size(), m_hook_name) == 0;
+			bool hook = Hook(arch_filename);
 			if (hook) {
+				// до хука отправляем все, что было раньше
+				for (; !queue.empty(); queue.pop_front())
+					Send(queue.front(), queued);
 				auto pos = filename.rfind('/');
 				script.AddParam('p', pos == std::string::npos ? "" : filename.substr(0, pos));
 				script.AddParam('f', pos == std::string::npos ? filename : filename.substr(pos + 1));
@@ -329,50 +691,68 @@ public:
 				if (!script.Do())
 					throw std::runtime_error("Failed to execute backup hook");
 			}
-			struct stat sb;
-			if (lstat(dir.RealPath().c_str(), &sb)) {
+			// после хука файл мог измениться
+			struct stat sb = dir.stat();
+			if (hook && lstat(dir.RealPath().c_str(), &sb)) {
 				//Warning("Failed to stat. Skip '%s'", dir.FullName().c_str());
 				continue;
 			}
-			if (info.Set(arch_filename, sb).type == AREGTYPE) {
+			Item item;
+			item.level = rule.level;
+			if (item.info.Set(arch_filename, sb).type == AREGTYPE) {
 				//Warning();
 				continue;
 			}
 			//std::cerr << "Pack " << dir.RealPath() << '\t' << info.size << std::endl;
-			io::FileIStream data; // убедиться что файл можно прочитать, иначе пропустить файл
-			if (info.type == SYMTYPE) {
+			if (item.info.type == SYMTYPE) {
 				char buf[sb.st_size + 1];
 				int size = readlink(dir.RealPath().c_str(), buf, sizeof(buf));
 				if (size == -1 || size >= (int)sizeof(buf)) {
 					// Warning();
 					continue;
 				}
-				info.linkname.assign(buf, size);
-			} else if (info.type == REGTYPE) {
+				item.info.linkname.assign(buf, size);
+			} else if (item.info.type == REGTYPE) {
 				if (sb.st_nlink > 1) {
 					auto res = m_hardlinks.insert(
-						std::make_pair(sb.st_ino, info.filename)
+						std::make_pair(sb.st_ino, item.info.filename)
 					);
 					if (!res.second) {
-						info.type = LNKTYPE;
-						info.linkname = res.first->second;
+						item.info.type = LNKTYPE;
+						item.info.linkname = res.first->second;
 					}
 				}
-				if (info.type == REGTYPE) {
-					data = io::FileIStream(dir.RealPath());
-					if (!data.fd())
+				if (item.info.type == REGTYPE) {
+					// убедиться что файл можно прочитать, иначе пропустить файл
+					item.data = io::FileIStream(dir.RealPath());
+					if (!item.data.fd())
 						continue;
+					// блоков меньше, чем байт: в файле могут быть дыры
+					if ((int64_t)sb.st_blocks * 512 < (int64_t)sb.st_size)
+						item.sparse.reset(new io::SparseIStream(item.data.fd(), sb.st_size));
 				}
 			}
-			if (m_send.SendInfo(info)) {
-				m_send.SendData(data);
-			}
 			if (hook) {
+				Send(item, queued);
 				script.AddParam('c', "end");
 				if (!script.Do())
 					throw std::runtime_error("Failed to execute backup hook");
+				continue;
+			}
+			if (m_prefetch && item.info.type == REGTYPE && !item.sparse && item.info.size > 0 &&
+					(int64_t)item.info.size <= m_read_window / 8 && m_send.NeedData(item.info)) {
+				m_prefetch->Add(item.data.fd(), item.info.size, sb.st_ino);
+				item.ahead = true;
+				queued += item.info.size;
+			}
+			queue.push_back(std::move(item));
+			while (!queue.empty() && (queued > m_read_window || queue.size() >= (m_prefetch ? PREFETCH_FILES : 1))) {
+				Send(queue.front(), queued);
+				queue.pop_front();
 			}
 		}
+		for (; !queue.empty(); queue.pop_front())
+			Send(queue.front(), queued);
 	}
 
 	void SetBackupHook(const std::string &prefix, const std::string &command) {
@@ -380,24 +760,51 @@ public:
 		m_hook_name = prefix;
 	}
 
+	void SetWalkThreads(int threads) { m_walk_threads = threads; }
+
+	void SetReadWindow(int64_t size) { m_read_window = size; }
+
 private:
+	struct Item {
+		tar::FileInfo info;
+		io::FileIStream data;
+		std::unique_ptr<io::SparseIStream> sparse;
+		/// данные читает m_prefetch
+		bool ahead;
+		/// уровень сжатия из правил
+		int level;
+		Item() : ahead(false), level(-1) {}
+	};
+
 	Sender &m_send;
-	args::StringVector m_exclude;
+	const rules::Matcher m_rules;
 	std::string m_hook;
 	std::string m_hook_name;
 	std::map<ino_t, std::string> m_hardlinks;
+	int m_walk_threads;
+	int64_t m_read_window;
+	std::unique_ptr<prefetch::Scheduler> m_prefetch;
 
-	bool Exclude(const std::string &filename) const {
-		ForEachI(m_exclude, exclude) {
-			//fnmatch не находит если слэш в конце
-			std::string _exclude = *exclude;
-			std::string::size_type size =_exclude.size() - 1;
-			if (_exclude[size] == '/')
-				_exclude.resize(size);
-			if (fnmatch(_exclude.c_str(), filename.c_str(), FNM_LEADING_DIR|FNM_EXTMATCH) == 0)
-				return true;
+	void Send(Item &item, int64_t &queued) {
+		std::string data;
+		if (item.ahead) {
+			data = m_prefetch->Take();
+			queued -= item.info.size;
 		}
-		return false;
+		m_send.SetRuleLevel(item.level);
+		if (!m_send.SendInfo(item.info))
+			return;
+		if (item.ahead) {
+			StrIStream in(data);
+			m_send.SendData(in);
+		} else if (item.sparse)
+			m_send.SendData(*item.sparse);
+		else
+			m_send.SendData(item.data);
+	}
+
+	bool Hook(const std::string &filename) const {
+		return !m_hook_name.empty() && filename.compare(0, m_hook_name.size(), m_hook_name) == 0;
 	}
 };
 
@@ -405,13 +812,13 @@ class TarReader {
 public:
 	TarReader(const std::string &data, const std::string &list,
 		const std::string &download)
-		: m_in(list.empty() ? data : list)
+		: m_name(data)
+		, m_in(list.empty() ? data : list)
 		, m_listing(m_in)
 		, m_file(data)
-		, m_file_data(m_file)
-		, m_file_limited_data(m_file_data)
 		, m_base(0)
-		, m_download(download) {
+		, m_download(download)
+		, m_prefetch(0) {
 		m_in.SetDownload(m_download);
 		m_file.SetDownload(m_download);
 		m_head = gzip::GetHeader(m_in);
@@ -420,6 +827,9 @@ public:
 		int64_t listing_size = misc::Int(m_head["listing_size"]);
 		m_in.Seek(0, -(listing_size + misc::Int(m_head["header_size"])), SEEK_END);
 		m_listing.Reset(listing_size);
+		m_list.reset(new listing::Reader(m_listing, listing::Version(m_head)));
+		m_file_data = codec::CreateIStream(Header("codec"), m_file);
+		m_file_limited_data.reset(new LIStream(*m_file_data));
 	}
 
 	~TarReader() {
@@ -428,36 +838,81 @@ public:
 	}
 
 	void AddBase(const std::string &filename) {
-		if (m_base)
+		if (m_base) {
 			m_base->AddBase(filename);
-		else
+		} else {
 			m_base = new TarReader(filename, "", m_download);
+			m_base->SetPrefetch(m_prefetch);
+		}
 	}
 
-	bool Read() {
-		auto pos = m_data.find('\n');
-		while (pos == std::string::npos) {
-			char buf[CHUNK];
-			int size = m_listing.Read(buf, sizeof(buf));
-			if (size <= 0)
-				return false;
-			m_data.append(buf, size);
-			pos = m_data.find('\n');
-		}
-		if (pos == 0)
+	/**
+	 * Копия для чтения данных из другого потока (листинг в копии не читается).
+	 * Заголовок, индекс и словарь берутся уже прочитанные, конец архива копия
+	 * не открывает. Скачанные slice копии делят между собой (slice::IStream)
+	 */
+	TarReader * Clone() const {
+		std::unique_ptr<TarReader> res(new TarReader(*this));
+		if (m_base)
+			res->m_base = m_base->Clone();
+		return res.release();
+	}
+
+	/// данные читаются последовательно, следующие slice можно скачивать заранее
+	void SetPrefetch(int count) {
+		m_prefetch = count;
+		m_file.SetPrefetch(count);
+		if (m_base)
+			m_base->SetPrefetch(count);
+	}
+
+	bool Read() { return m_list->Read(m_info, m_line); }
+
+	/**
+	 * Перейти по индексу листинга к блоку, в котором может быть path. Если
+	 * чтение уже дошло до этого блока, листинг просто читается дальше.
+	 * false, если у архива нет индекса
+	 */
+	bool SeekListing(const std::string &path) {
+		const std::string index_pos = Header("listing_index");
+		if (index_pos.empty())
 			return false;
-		m_line = m_data.substr(0, pos);
-		m_info.Set(m_line);
-		m_data.erase(0, pos + 1);
+		// после чтения индекса позиция листинга потеряна
+		bool loaded = !m_index.empty();
+		if (!loaded)
+			LoadIndex(misc::Int(index_pos));
+		// последний блок, начинающийся не позже path
+		auto block = std::upper_bound(m_index.begin(), m_index.end(), path,
+			[](const std::string &path, const std::pair<std::string, int64_t> &entry) {
+				return file::DirTree::AlphaSort(path.c_str(), entry.first.c_str()) < 0;
+			});
+		if (block != m_index.begin())
+			--block;
+		if (loaded && !m_info.filename.empty() &&
+			file::DirTree::AlphaSort(m_info.filename.c_str(), block->first.c_str()) >= 0)
+			return true;
+		int64_t listing_size = misc::Int(m_head["listing_size"]);
+		m_in.Seek(0, block->second - (listing_size + misc::Int(m_head["header_size"])), SEEK_END);
+		if (block->second)
+			m_listing.Resume(listing_size - block->second);
+		else
+			m_listing.Reset(listing_size);
+		m_list->Restart();
 		return true;
 	}
 
 	tar::FileInfo & info() { return m_info; }
 	std::string Offset() const { return m_line; }
-	io::IStream & data() {
+	/// данные файла, начиная с offset (с ближайшей контрольной точки, если они есть)
+	io::IStream & data(int64_t offset = 0) {
 		std::string tmp = m_line;
 		int depth = misc::Int(misc::GetWord(tmp, ':'));
-		return GetData(depth, tmp, m_info.size);
+		return GetData(depth, tmp, m_info.size, offset);
+	}
+	/// данные файла по строке из Offset()
+	io::IStream & data(std::string offs, tar::FileSizeType size) {
+		int depth = misc::Int(misc::GetWord(offs, ':'));
+		return GetData(depth, offs, size);
 	}
 
 	std::string Header(const std::string &name) {
@@ -465,18 +920,118 @@ public:
 		return pos == m_head.end() ? "" : pos->second;
 	}
 
+	/**
+	 * Скопировать gzip member файла в out без распаковки. false (ничего не
+	 * записано), если так нельзя: другой кодек, общий словарь или контрольные
+	 * точки, позиции которых пришлось бы пересчитывать. Целые блоки с данными
+	 * копируются как есть, конец данных в последнем блоке сжимается заново
+	 * (gzip::DataEnd), дальше member закрывается
+	 */
+	bool CopyMember(io::OStream &out) {
+		std::string tmp = m_line;
+		int depth = misc::Int(misc::GetWord(tmp, ':'));
+		return CopyMember(depth, tmp, m_info.size, out);
+	}
+	/// то же по строке из Offset()
+	bool CopyMember(std::string offs, tar::FileSizeType size, io::OStream &out) {
+		int depth = misc::Int(misc::GetWord(offs, ':'));
+		return CopyMember(depth, offs, size, out);
+	}
+
 private:
+	/// для Clone
+	TarReader(const TarReader &src)
+		: m_name(src.m_name)
+		, m_in(src.m_name)
+		, m_listing(m_in)
+		, m_file(src.m_name)
+		, m_base(0)
+		, m_download(src.m_download)
+		, m_prefetch(src.m_prefetch)
+		, m_head(src.m_head)
+		, m_dictionary(src.m_dictionary)
+		, m_index(src.m_index) {
+		m_in.SetDownload(m_download);
+		m_file.SetDownload(m_download);
+		m_file.SetPrefetch(m_prefetch);
+		m_file_data = codec::CreateIStream(Header("codec"), m_file);
+		m_file_limited_data.reset(new LIStream(*m_file_data));
+	}
+
+	const std::string m_name;
 	slice::IStream m_in;
 	gzip::IStream m_listing;
+	std::unique_ptr<listing::Reader> m_list;
 	tar::FileInfo m_info;
-	std::string m_data;
 	std::string m_line;
 	slice::IStream m_file;
-	gzip::IStream m_file_data;
-	LIStream m_file_limited_data;
+	codec::IStreamPtr m_file_data;
+	std::unique_ptr<LIStream> m_file_limited_data;
 	TarReader *m_base;
 	const std::string m_download;
+	int m_prefetch;
 	std::map<std::string, std::string> m_head;
+	std::string m_dictionary;
+	std::vector<std::pair<std::string, int64_t> > m_index;
+
+	bool CopyMember(int depth, std::string tmp, tar::FileSizeType size, io::OStream &out) {
+		if (depth) {
+			if (!m_base)
+				throw std::runtime_error("Failed to get file from base");
+			return m_base->CopyMember(depth - 1, tmp, size, out);
+		}
+		std::string codec = Header("codec");
+		if ((!codec.empty() && codec != "gzip") || !GetAttr(tmp, "d").empty() || !GetAttr(tmp, "c").empty())
+			return false;
+		int64_t file = misc::Int(misc::GetWord(tmp, ':'));
+		int64_t pos = misc::Int(misc::GetWord(tmp, ':'));
+		const int64_t data_size = (size + 511) / 512 * 512;
+		gzip::DataTail tail;
+		m_file.Seek(file, pos, SEEK_SET);
+		if (!gzip::DataEnd(m_file, data_size, tail))
+			return false;
+		m_file.Seek(file, pos, SEEK_SET);
+		gzip::CopyData(m_file, out, tail, data_size);
+		return true;
+	}
+
+	/// индекс листинга: имя первой записи блока и смещение блока в листинге
+	void LoadIndex(int64_t pos) {
+		int64_t listing_size = misc::Int(m_head["listing_size"]);
+		m_in.Seek(0, pos - (listing_size + misc::Int(m_head["header_size"])), SEEK_END);
+		gzip::IStream in(m_in, listing_size - pos);
+		std::string data;
+		char buf[CHUNK];
+		int size;
+		while ((size = in.Read(buf, sizeof(buf))) > 0)
+			data.append(buf, size);
+		for (std::string::size_type start = 0, end; (end = data.find('\n', start)) != std::string::npos; start = end + 1) {
+			std::string line = data.substr(start, end - start);
+			std::string name = tar::FileInfo::DecodeFileName(misc::GetWord(line, '\t'));
+			m_index.push_back(std::make_pair(name, misc::Int(line)));
+		}
+		if (m_index.empty())
+			throw std::runtime_error("Bad listing index");
+	}
+
+	/// общий словарь архива читается при первом обращении
+	const std::string & Dictionary() {
+		if (m_dictionary.empty()) {
+			std::string offs = Header("dictionary");
+			if (offs.empty())
+				throw std::runtime_error("No dictionary found");
+			int64_t file = misc::Int(misc::GetWord(offs, ':'));
+			m_file.Seek(file, misc::Int(offs), SEEK_SET);
+			m_file_data->SetDictionary("");
+			m_file_data->Reset();
+			m_file_limited_data->Reset(misc::Int(Header("dictionary_size")));
+			char buf[CHUNK];
+			int size;
+			while ((size = m_file_limited_data->Read(buf, sizeof(buf))) > 0)
+				m_dictionary.append(buf, size);
+		}
+		return m_dictionary;
+	}
 
 	/**
 	 * Для того, чтобы прочитать отдельный файл используется класс LIStream
@@ -487,40 +1042,296 @@ private:
 	 * чтении пограничного блока может возникать переключение между слайсами
 	 * (в обратную сторону)
 	 */
-	io::IStream & GetData(int depth, std::string tmp, tar::FileSizeType size) {
+	io::IStream & GetData(int depth, std::string tmp, tar::FileSizeType size, int64_t offset = 0) {
 		if (depth) {
 			if (!m_base)
 				throw std::runtime_error("Failed to get file from base");
-			return m_base->GetData(depth - 1, tmp, size);
+			return m_base->GetData(depth - 1, tmp, size, offset);
 		}
 		int64_t file = misc::Int(misc::GetWord(tmp, ':'));
 		int64_t pos = misc::Int(misc::GetWord(tmp, ':'));
 		/*int gz_offs = misc::Int(misc::GetWord(tmp, '\t'))*/;
+		int64_t start = 0;
+		if (offset > 0) {
+			std::string points = GetAttr(tmp, "c");
+			while (!points.empty()) {
+				std::string point = misc::GetWord(points, ',');
+				int64_t point_pos = misc::Int(misc::GetWord(point, ':'));
+				if (point_pos > offset)
+					break;
+				start = point_pos;
+				file = misc::Int(misc::GetWord(point, ':'));
+				pos = misc::Int(point);
+			}
+		}
+		m_file_data->SetDictionary(GetAttr(tmp, "d").empty() ? "" : Dictionary());
 		m_file.Seek(file, pos, SEEK_SET);
-		m_file_data.Reset();
-		//m_file_data.Seek(offs, SEEK_CUR);
-		m_file_limited_data.Reset(size);
-		return m_file_limited_data;
+		if (start)
+			m_file_data->Resume();
+		else
+			m_file_data->Reset();
+		m_file_limited_data->Reset(size - start);
+		char buf[CHUNK];
+		for (int64_t left = offset - start; left > 0; ) {
+			int res = m_file_limited_data->Read(buf, std::min(left, (int64_t)sizeof(buf)));
+			if (res <= 0)
+				throw std::runtime_error("Unexpected end of file data");
+			left -= res;
+		}
+		return *m_file_limited_data;
 	}
 };
 
+/**
+ * Параллельная распаковка в --root. Каталоги, ссылки и пустые файлы по-прежнему
+ * создаются по листингу в основном потоке, а данные файлов распаковываются в
+ * пуле потоков пачками из одного slice. У каждого потока своя копия TarReader.
+ * Файлы создает основной поток, и в очереди одновременно открыто не больше
+ * PARALLEL_OPEN_FILES из них. slice для потоков тоже открывает основной (см.
+ * slice::OpenQueue), так что euid под --user никогда не меняется в рабочих
+ */
+class ParallelExtract {
+public:
+	ParallelExtract(TarReader &reader, int threads)
+		: m_reader(reader)
+		, m_batch(new Batch)
+		, m_batch_size(0)
+		, m_batch_files(std::max(1, std::min(BATCH_FILES, PARALLEL_OPEN_FILES / (threads * 2 + 1))))
+		, m_pool(new thread::Pool(threads)) {
+		// копии делаются здесь: рабочие потоки не трогают основной TarReader
+		for (int i = 0; i < threads; ++i) {
+			m_readers.push_back(std::unique_ptr<TarReader>(m_reader.Clone()));
+			m_free.push_back(m_readers.back().get());
+		}
+	}
+
+	~ParallelExtract() {
+		m_opener.Stop();
+		m_pool.reset();
+	}
+
+	void Add(const tar::FileInfo &info, const std::string &offs, const io::ResHandle &fd) {
+		m_opener.Serve();
+		std::string tmp = offs;
+		std::string key = misc::GetWord(tmp, ':');
+		key += ':' + misc::GetWord(tmp, ':');
+		if (key != m_key || (int)m_batch->jobs.size() >= m_batch_files || m_batch_size >= BATCH_SIZE)
+			Submit();
+		m_key = key;
+		Job job;
+		job.info.filename = info.filename;
+		job.info.size = info.size;
+		job.info.time = info.time;
+		job.offs = offs;
+		job.fd = fd;
+		m_batch->jobs.push_back(job);
+		m_batch_size += info.size;
+	}
+
+	void Finish() {
+		Submit();
+		Drain(0);
+	}
+
+private:
+	struct Job {
+		tar::FileInfo info;
+		std::string offs;
+		io::ResHandle fd;
+	};
+	struct Batch {
+		std::vector<Job> jobs;
+		std::vector<std::string> errors;
+		std::future<void> done;
+		/// поток закончил пачку, done вот-вот будет готов
+		std::atomic<bool> finished;
+		Batch() : finished(false) {}
+	};
+	typedef std::shared_ptr<Batch> BatchPtr;
+
+	TarReader &m_reader;
+	BatchPtr m_batch;
+	int64_t m_batch_size;
+	/// в очереди до 2 * threads + 1 пачек, их файлы держат открытые fd
+	const int m_batch_files;
+	std::string m_key;
+	std::deque<BatchPtr> m_queue;
+	std::mutex m_mutex;
+	std::vector<std::unique_ptr<TarReader> > m_readers;
+	std::vector<TarReader *> m_free;
+	slice::OpenQueue m_opener;
+	std::unique_ptr<thread::Pool> m_pool;
+
+	void Submit() {
+		if (m_batch->jobs.empty())
+			return;
+		BatchPtr batch = m_batch;
+		batch->done = m_pool->Add([this, batch] { Extract(*batch); });
+		m_queue.push_back(batch);
+		m_batch.reset(new Batch);
+		m_batch_size = 0;
+		Drain(m_pool->size() * 2);
+	}
+
+	void Drain(size_t limit) {
+		while (m_queue.size() > limit) {
+			BatchPtr batch = m_queue.front();
+			m_queue.pop_front();
+			m_opener.ServeUntil([&batch] { return (bool)batch->finished; });
+			batch->done.get();
+			ForEachI(batch->errors, error)
+				std::cerr << *error << std::endl;
+		}
+	}
+
+	/// копий столько же, сколько потоков, свободная есть всегда
+	TarReader * Take() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		TarReader *res = m_free.back();
+		m_free.pop_back();
+		return res;
+	}
+
+	void Extract(Batch &batch) {
+		slice::OpenQueue::Worker worker(m_opener);
+		std::shared_ptr<Batch> finish(&batch, [this](Batch *batch) {
+			batch->finished = true;
+			m_opener.Notify();
+		});
+		TarReader *reader = Take();
+		std::shared_ptr<TarReader> guard(reader, [this](TarReader *reader) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_free.push_back(reader);
+		});
+		ForEachI(batch.jobs, job) {
+			try {
+				job->info.Fill(job->fd, reader->data(job->offs, job->info.size), GetAttr(job->offs, "s"));
+			} catch (const slice::error &) {
+				throw;
+			} catch (const std::exception &e) {
+				batch.errors.push_back(job->info.filename + '\t' + e.what());
+			}
+			job->fd = io::ResHandle();
+		}
+	}
+};
+
+/**
+ * Восстановление в порядке расположения данных. Каталоги и прочие записи без
+ * данных создаются по листингу сразу, а файлы запоминаются и затем читаются
+ * по возрастанию (глубина базы, slice, смещение), так что каждый slice каждого
+ * архива читается (и скачивается) один раз. Жесткие ссылки создаются в конце
+ */
+class OrderedExtract {
+public:
+	/// false, если запись нужно создать сразу
+	bool Add(const tar::FileInfo &info, const std::string &offs) {
+		if (info.type == LNKTYPE) {
+			m_links.push_back(info.Str());
+			return true;
+		}
+		if (info.type != REGTYPE || info.size == 0)
+			return false;
+		Entry entry;
+		std::string tmp = offs;
+		entry.depth = misc::Int(misc::GetWord(tmp, ':'));
+		entry.slice = misc::Int(misc::GetWord(tmp, ':'));
+		entry.offset = misc::Int(misc::GetWord(tmp, ':'));
+		entry.line = info.Str() + '\t' + offs;
+		m_files.push_back(entry);
+		return true;
+	}
+
+	void Finish(TarReader &reader, const std::string &root, ParallelExtract *parallel) {
+		std::sort(m_files.begin(), m_files.end());
+		tar::FileInfo info;
+		ForEachI(m_files, entry) {
+			std::string offs = entry->line;
+			info.Set(offs);
+			try {
+				if (parallel)
+					parallel->Add(info, offs, info.Create(root));
+				else
+					info.Create(root, reader.data(offs, info.size), GetAttr(offs, "s"));
+			} catch (const slice::error &) {
+				throw;
+			} catch (const std::exception &e) {
+				std::cerr << info.filename << '\t' << e.what() << std::endl;
+			}
+		}
+		std::vector<Entry>().swap(m_files);
+		ForEachI(m_links, line) {
+			info.Set(*line);
+			try {
+				info.Create(root);
+			} catch (const std::exception &e) {
+				std::cerr << info.filename << '\t' << e.what() << std::endl;
+			}
+		}
+	}
+
+private:
+	struct Entry {
+		int64_t depth;
+		int64_t slice;
+		int64_t offset;
+		std::string line;
+		bool operator < (const Entry &entry) const {
+			if (depth != entry.depth)
+				return depth < entry.depth;
+			if (slice != entry.slice)
+				return slice < entry.slice;
+			return offset < entry.offset;
+		}
+	};
+	std::vector<Entry> m_files;
+	std::vector<std::string> m_links;
+};
+
+/**
+ * Первая запись базы с именем не меньше filename. Листинг дочитывается по
+ * мере надобности; с drop записи до найденной выбрасываются (GetPrevInfo),
+ * без него поиск продолжается с места прошлого (NeedData)
+ */
+const Sender::PrevEntry * Sender::FindPrev(const std::string &filename, bool drop) {
+	size_t pos = drop ? 0 : m_peek;
+	while (true) {
+		while (pos < m_prev.size() && file::DirTree::AlphaSort(m_prev[pos].info.filename.c_str(), filename.c_str()) < 0)
+			++pos;
+		if (pos < m_prev.size() || m_source_end)
+			break;
+		if (!m_source->Read()) {
+			m_source_end = true;
+			break;
+		}
+		m_prev.push_back(PrevEntry{std::move(m_source->info()), m_source->Offset()});
+	}
+	if (drop) {
+		m_prev.erase(m_prev.begin(), m_prev.begin() + pos);
+		m_peek = m_peek > pos ? m_peek - pos : 0;
+		pos = 0;
+	} else
+		m_peek = pos;
+	return pos < m_prev.size() ? &m_prev[pos] : NULL;
+}
+
 Sender::PrevInfo Sender::GetPrevInfo(const tar::FileInfo &info) {
 	PrevInfo res;
 	if (m_source) {
-		while (file::DirTree::AlphaSort(m_source->info().filename.c_str(), info.filename .c_str()) < 0 && m_source->Read()) {
-			//std::cout << "Skip " << m_source->info().filename << std::endl;
-		}
-		if (m_source->info() == info) {
+		const PrevEntry *prev = FindPrev(info.filename, true);
+		if (prev && prev->info == info) {
 			res.found = true;
 			if (info.type == REGTYPE) {
 				if (info.size > 0) {
 					if (m_reference) {
-						std::string offs = m_source->Offset();
+						std::string offs = prev->offs;
 						int backup = misc::Int(misc::GetWord(offs, ':'));
 						offs = misc::Str(backup + 1) + ':' + offs;
 						res.file_offs = offs;
-					} else
-						res.file_data = &m_source->data();
+					} else {
+						res.file_data = &m_source->data(prev->offs, info.size);
+						res.file_extents = GetAttr(prev->offs, "s");
+					}
 				} else if (!m_reference)
 					res.found = false;
 			}
@@ -529,6 +1340,13 @@ Sender::PrevInfo Sender::GetPrevInfo(const tar::FileInfo &info) {
 	return res;
 }
 
+bool Sender::NeedData(const tar::FileInfo &info) {
+	if (!m_source)
+		return true;
+	const PrevEntry *prev = FindPrev(info.filename, false);
+	return !prev || !(prev->info == info);
+}
+
 bool GetInfoFromStdin(tar::FileInfo &info) {
 	int16_t size;
 	if (read(0, &size, sizeof(size)) != sizeof(size))
@@ -556,7 +1374,7 @@ bool GetInfoFromStdin(tar::FileInfo &info) {
 class StdinIStream : public io::IStream {
 public:
 	StdinIStream() : m_chunk_size(0) {}
-	int Read(char *buf, int size) {
+	int64_t Read(char *buf, int64_t size) {
 		if (!m_chunk_size) {
 			////std::cerr << "READ " << sizeof(m_chunk_size) << std::endl;
 			if (read(0, &m_chunk_size, sizeof(m_chunk_size)) != sizeof(m_chunk_size))
@@ -575,20 +1393,109 @@ private:
 	int16_t m_chunk_size;
 };
 
-bool CheckName(const args::StringVector &args, const std::string &name) {
+/// name совпадает с arg или лежит внутри него
+static bool MatchName(const std::string &arg, const std::string &name) {
+	return name.compare(0, arg.size(), arg) == 0 &&
+		(name.size() == arg.size() || name[arg.size()] == '/' || arg[arg.size() - 1] == '/');
+}
+
+bool CheckPath(const std::string &name) {
 	if (name[0] == '/' || name.find("/../") != std::string::npos || name.compare(0, 3, "../") == 0) {
 		std::cerr << "Ignoring bad path " << name << std::endl;
 		return false;
 	}
-	if (args.empty())
-		return true;
-	ForEachI(args, arg)
-		if (name.compare(0, arg->size(), *arg) == 0 &&
-			(name.size() == arg->size() || name[arg->size()] == '/' || arg->at(arg->size() - 1) == '/'))
-			return true;
-	return false;
+	return true;
+}
+
+/// пути из файла, разделенные '\0' (если он есть) или переводом строки
+void ReadPaths(const std::string &filename, args::StringVector &paths) {
+	io::FileIStream in(filename);
+	if (!in.fd())
+		throw std::runtime_error("Failed to open '" + filename + "'");
+	std::string data;
+	char buf[CHUNK];
+	int size;
+	while ((size = in.Read(buf, sizeof(buf))) > 0)
+		data.append(buf, size);
+	const char sep = data.find('\0') == std::string::npos ? '\n' : '\0';
+	for (std::string::size_type start = 0, end; start < data.size(); start = end + 1) {
+		end = data.find(sep, start);
+		if (end == std::string::npos)
+			end = data.size();
+		if (end > start)
+			paths.push_back(data.substr(start, end - start));
+	}
 }
 
+/**
+ * Правила отбора файлов из --include, --exclude и --rules именно в таком
+ * порядке: срабатывает первое подошедшее, так что --include важнее
+ */
+rules::Matcher GetRules(const args::Args &args) {
+	rules::Matcher res;
+	const args::StringVector include = args->Params("include");
+	ForEachI(include, pattern)
+		res.Add(rules::KEEP, *pattern);
+	const args::StringVector exclude = args->Params("exclude");
+	ForEachI(exclude, pattern)
+		res.Add(rules::SKIP, *pattern);
+	if (args->Has("rules"))
+		res.Load(args["rules"]);
+	return res;
+}
+
+/**
+ * Записи листинга, подходящие под args. Аргументы сортируются и перебираются
+ * вместе с листингом (он тоже отсортирован), так что каждая запись сверяется
+ * только с текущим аргументом. Между аргументами листинг пропускается по
+ * индексу (если он есть), так что извлечение одного файла не читает весь листинг
+ */
+class ListingFilter {
+public:
+	ListingFilter(TarReader &reader, const args::StringVector &args)
+		: m_reader(reader)
+		, m_args(args)
+		, m_arg(0)
+		, m_have(false) {
+		std::sort(m_args.begin(), m_args.end(), [](const std::string &a, const std::string &b) {
+			return file::DirTree::AlphaSort(a.c_str(), b.c_str()) < 0;
+		});
+		// вложенные аргументы уже покрыты предыдущими
+		args::StringVector uniq;
+		ForEachI(m_args, arg)
+			if (!arg->empty() && (uniq.empty() || !MatchName(uniq.back(), *arg)))
+				uniq.push_back(*arg);
+		m_args.swap(uniq);
+	}
+
+	bool Next() {
+		if (m_args.empty())
+			return m_reader.Read();
+		while (m_arg < m_args.size()) {
+			const std::string &arg = m_args[m_arg];
+			if (!m_have && !m_reader.Read())
+				return false;
+			m_have = false;
+			const std::string &name = m_reader.info().filename;
+			if (MatchName(arg, name))
+				return true;
+			if (file::DirTree::AlphaSort(name.c_str(), arg.c_str()) > 0) {
+				// эта запись может подойти под следующий аргумент
+				++m_arg;
+				m_have = true;
+			} else
+				m_reader.SeekListing(arg);
+		}
+		return false;
+	}
+
+private:
+	TarReader &m_reader;
+	args::StringVector m_args;
+	size_t m_arg;
+	bool m_have;
+};
+
 bool ValidSize(std::string &str) {
 	if (str.empty())
 		return false;
@@ -621,6 +1528,240 @@ static std::string GetPart(std::string &parts) {
 	return name;
 }
 
+/**
+ * Перенарезка архива на slice другого размера. Данные (все до заголовка tar
+ * с листингом) копируются побайтно, позиции в листинге и заголовке
+ * пересчитываются через смещение от начала архива, затем листинг, заголовок
+ * и footer пишутся заново. Инкрементальные архивы, для которых этот был
+ * базовым, ссылаются на старую нарезку
+ */
+class Reslicer {
+public:
+	Reslicer(slice::IStream &in, slice::OStream &out, int64_t slice_size)
+		: m_in(in)
+		, m_out(out)
+		, m_slice_size(slice_size) {}
+
+	void Run(TarSender &sender, std::map<std::string, std::string> &head) {
+		int64_t listing_size = misc::Int(head["listing_size"]);
+		int64_t tail = listing_size + misc::Int(head["header_size"]);
+		// перед листингом лежит member с заголовком tar для .backup.info
+		auto listing = m_in.Seek(0, -tail, SEEK_END);
+		std::string info(listing.first > 1 ? 1024 : std::min((int64_t)1024, listing.second), '\0');
+		m_in.Seek(0, -(tail + (int64_t)info.size()), SEEK_END);
+		for (size_t done = 0; done < info.size(); ) {
+			int res = m_in.Read(&info[done], info.size() - done);
+			if (res <= 0)
+				throw std::runtime_error("Failed to read archive");
+			done += res;
+		}
+		int start = gzip::LastMember(info);
+		if (start == -1)
+			throw std::runtime_error("Failed to find listing header");
+		CopyData(m_in.Seek(0, -(tail + (int64_t)info.size() - start), SEEK_END));
+
+		m_in.Seek(0, -tail, SEEK_END);
+		gzip::IStream in(m_in, listing_size);
+		listing::Reader reader(in, listing::Version(head));
+		tar::FileInfo file;
+		std::string offs;
+		while (reader.Read(file, offs))
+			sender.WriteListing(Line(listing::Line(file, offs)));
+		ForEachI(head, field)
+			if (field->first.compare(0, 8, "listing_") != 0 && field->first != "header_size" &&
+				field->first != "codec" && field->first != "parts")
+				sender.SetHeader(field->first, field->first == "dictionary" ? Pos(field->second) : field->second);
+		sender.WriteFooter(head["parts"]);
+	}
+
+private:
+	slice::IStream &m_in;
+	slice::OStream &m_out;
+	const int64_t m_slice_size;
+	/// смещение начала каждого исходного slice от начала архива
+	std::map<int64_t, int64_t> m_starts;
+
+	void CopyData(slice::Offs end) {
+		std::vector<char> buf(1024 * 1024);
+		int64_t done = 0;
+		m_in.Seek(1, 0, SEEK_SET);
+		for (auto pos = m_in.Tell(); pos != end; ) {
+			m_starts.insert(std::make_pair(pos.first, done - pos.second));
+			int64_t len = buf.size();
+			if (pos.first == end.first)
+				len = std::min(len, end.second - pos.second);
+			int res = m_in.Read(&buf[0], len);
+			if (res <= 0)
+				throw std::runtime_error("Failed to read archive");
+			// чтение могло перейти в следующий slice и зайти за конец данных
+			pos = m_in.Tell();
+			m_starts.insert(std::make_pair(pos.first, done + res - pos.second));
+			if (pos.first == end.first && pos.second > end.second) {
+				res -= pos.second - end.second;
+				pos = end;
+			}
+			m_out.Write(&buf[0], res);
+			done += res;
+		}
+	}
+
+	/// "slice:смещение" в исходном архиве -> в новом
+	std::string Pos(std::string pos) {
+		int64_t file = misc::Int(misc::GetWord(pos, ':'));
+		auto start = m_starts.find(file);
+		if (start == m_starts.end())
+			throw std::runtime_error("Bad data position");
+		int64_t offset = start->second + misc::Int(pos);
+		// как slice::OStream: заполненный slice не закрывается до следующей записи
+		int64_t slice = offset ? (offset - 1) / m_slice_size + 1 : 1;
+		return misc::Str(slice) + ':' + misc::Str(offset - (slice - 1) * m_slice_size);
+	}
+
+	std::string Line(const std::string &line) {
+		std::string offs = line;
+		tar::FileInfo info;
+		info.Set(offs);
+		if (offs.empty() || misc::GetWord(offs, ':') != "0")
+			return line;
+		std::string file = misc::GetWord(offs, ':');
+		std::string res = info.Str() + "\t0:" + Pos(file + ':' + misc::GetWord(offs, ':')) + ':';
+		res += misc::GetWord(offs, '\t');
+		while (!offs.empty()) {
+			std::string attr = misc::GetWord(offs, '\t');
+			if (attr.compare(0, 2, "c=") == 0) {
+				std::string points = attr.substr(2);
+				attr = "c=";
+				while (!points.empty()) {
+					std::string point = misc::GetWord(points, ',');
+					std::string done = misc::GetWord(point, ':');
+					attr += (attr.size() > 2 ? "," : "") + done + ':' + Pos(point);
+				}
+			}
+			res += '\t' + attr;
+		}
+		return res;
+	}
+};
+
+/**
+ * Полный архив из инкрементального и его базовых. Записи идут в порядке
+ * листинга нового архива, данные берутся из того архива цепочки, где они
+ * лежат. Для каждого исходного архива свой поток со своей копией TarReader,
+ * который заранее (в пределах окна) читает member в память: как есть, если
+ * можно копировать без пересжатия, иначе распакованными. Файлы больше
+ * BATCH_SIZE читаются основным потоком при записи. slice для потоков
+ * открывает основной (см. slice::OpenQueue)
+ */
+class Consolidator {
+public:
+	Consolidator(TarReader &reader, TarSender &sender, bool raw)
+		: m_reader(reader)
+		, m_sender(sender)
+		, m_raw(raw)
+		, m_size(0) {}
+
+	~Consolidator() {
+		m_opener.Stop();
+		m_sources.clear();
+	}
+
+	void Run() {
+		while (m_reader.Read()) {
+			m_opener.Serve();
+			ItemPtr item(new Item);
+			item->info = m_reader.info();
+			item->offs = m_reader.Offset();
+			if (item->info.type == REGTYPE && item->info.size > 0 && item->info.size <= BATCH_SIZE) {
+				std::string tmp = item->offs;
+				Source &source = m_sources[misc::Int(misc::GetWord(tmp, ':'))];
+				if (!source.pool) {
+					source.reader.reset(m_reader.Clone());
+					source.pool.reset(new thread::Pool(1));
+				}
+				TarReader *reader = source.reader.get();
+				item->done = source.pool->Add([this, item, reader] { Load(*item, *reader); });
+				m_size += item->info.size;
+			}
+			m_queue.push_back(item);
+			Drain(BATCH_FILES * 4, BATCH_SIZE * 2);
+		}
+		Drain(0, 0);
+	}
+
+private:
+	struct Item {
+		tar::FileInfo info;
+		std::string offs;
+		std::string data;
+		bool raw;
+		std::future<void> done;
+		/// поток прочитал файл, done вот-вот будет готов
+		std::atomic<bool> finished;
+		Item() : finished(false) {}
+	};
+	typedef std::shared_ptr<Item> ItemPtr;
+	struct Source {
+		std::unique_ptr<TarReader> reader;
+		std::unique_ptr<thread::Pool> pool;
+	};
+
+	TarReader &m_reader;
+	TarSender &m_sender;
+	const bool m_raw;
+	int64_t m_size;
+	std::deque<ItemPtr> m_queue;
+	slice::OpenQueue m_opener;
+	std::map<int, Source> m_sources;
+
+	void Load(Item &item, TarReader &reader) {
+		slice::OpenQueue::Worker worker(m_opener);
+		std::shared_ptr<Item> finish(&item, [this](Item *item) {
+			item->finished = true;
+			m_opener.Notify();
+		});
+		StrOStream out(item.data);
+		item.raw = m_raw && reader.CopyMember(item.offs, item.info.size, out);
+		if (item.raw)
+			return;
+		io::IStream &in = reader.data(item.offs, item.info.size);
+		char buf[CHUNK];
+		int size;
+		while ((size = in.Read(buf, sizeof(buf))) > 0)
+			item.data.append(buf, size);
+	}
+
+	void Drain(size_t files, int64_t size) {
+		while (!m_queue.empty() && (m_queue.size() > files || m_size > size)) {
+			ItemPtr item = m_queue.front();
+			m_queue.pop_front();
+			Send(*item);
+		}
+	}
+
+	void Send(Item &item) {
+		if (item.done.valid()) {
+			m_opener.ServeUntil([&item] { return (bool)item.finished; });
+			item.done.get();
+			m_size -= item.info.size;
+		}
+		if (!m_sender.SendInfo(item.info))
+			return;
+		if (!item.done.valid()) {
+			if (!(m_raw && m_sender.SendMember(
+					[this, &item](io::OStream &out) { return m_reader.CopyMember(item.offs, item.info.size, out); }, item.offs)))
+				m_sender.SendData(m_reader.data(item.offs, item.info.size), GetAttr(item.offs, "s"));
+		} else if (item.raw) {
+			m_sender.SendMember([&item](io::OStream &out) {
+				out.Write(item.data.data(), item.data.size());
+				return true;
+			}, item.offs);
+		} else {
+			StrIStream in(item.data);
+			m_sender.SendData(in, GetAttr(item.offs, "s"));
+		}
+	}
+};
+
 static void SetEUid(const std::string &username) {
 	struct passwd *pw;
 	if (username.find_first_not_of("0123456789") == std::string::npos)
@@ -647,17 +1788,26 @@ int main(int argc, const char *argv[]) {
 		args::Args args("ISPsystem backup tool");
 		args
 			.AddOption("execute", 'E', "execute command to get slice if it missed or upload after it was created").SetParam()
+			.AddOption("upload-jobs", 'J', "run up to specified number of upload commands in background").SetParam()
+			.AddOption("prefetch", 'Q', "download specified number of next slices in background while reading").SetParam()
+			.AddOption("io-buffer", 'I', "size of buffers for reading and writing file data").SetValidator(ValidSize)
+			.AddOption("no-cache", 'N', "don't leave read and written file data in page cache")
+			.AddOption("direct-io", 'G', "write slices with O_DIRECT (implies --no-cache)")
 			.AddOption("extract", 'x', "extract files from backup")
 				.SetGroup("command").SetParam().SetRequired()
 				.AddSuboption("base", 'B', "path to base archive for difencial backup")
 					.SetParam().SetMultiple()
 				.AddOption("listing", 'L', "Get file list from specified file").SetParam()
+				.AddOption("files-from", 'f', "extract paths listed in file (newline or NUL separated)").SetParam()
 				.AddOption("root", 'R', "extract files to specified folder")
 					.SetDefault(get_current_dir_name()).SetGroup("dest")
 					.AddSuboption("user", 'U', "act as specified user").SetParam()
+					.AddOption("threads", 't', "extract file data using specified number of threads").SetParam()
+					.AddOption("physical-order", 'O', "extract file data in archive order reading every slice once")
 					.Last()
 				.AddOption("tar", 'T', "extract files to tar archive").SetParam().SetGroup("dest")
 					.AddSuboption("plain-file", 'P', "write single file content to stream").SetParam()
+					.AddOption("range", 'r', "write only part of plain file (OFFSET[:LENGTH])").SetParam()
 					.Last()
 				.AddOption("list-only", 'D', "list files without extracting data").SetGroup("dest")
 				.Last()
@@ -672,10 +1822,21 @@ int main(int argc, const char *argv[]) {
 				.AddOption("ref-execute", 'F', "execute command to get base slice if it missed")
 				.AddOption("save-listing", 'S', "keep new listing file").SetParam()
 				.AddOption("exclude", 'X', "exclude files from backup").SetMultiple().SetParam()
+				.AddOption("include", 'A', "back up files matching pattern even if --exclude or --rules excludes them or their directory").SetMultiple().SetParam()
+				.AddOption("rules", 'u', "read rules from file: 'exclude|include|store PATTERN' or 'level N PATTERN' per line").SetParam()
 				.AddOption("root", 'R', "search files starting from this folder").SetDefault(get_current_dir_name())
 				.AddOption("backup-hook", '<', "execute script before and after backup following files").SetParam()
 					.AddSuboption("backup-hook-execute", '>', "script name to execute").SetRequired()
 					.Last()
+				.AddOption("threads", 't', "compress data using specified number of threads").SetParam()
+				.AddOption("codec", 'z', "compress data using gzip (default), zstd or lz4").SetParam()
+				.AddOption("level", 'Z', "compression level for selected codec").SetParam()
+				.AddOption("adaptive", 'a', "choose compression level for every file by compressing its first bytes")
+				.AddOption("checkpoint", 'k', "make random access point inside large files every specified size").SetValidator(ValidSize)
+				.AddOption("dictionary", 'y', "compress small files with shared dictionary: 'auto' to build it from first files or dictionary file name (not readable by older isptar versions, gzip or tar)").SetParam()
+				.AddOption("binary-listing", 'b', "write compact binary listing (not readable by older isptar versions)")
+				.AddOption("walk-threads", 'w', "read directories using specified number of threads").SetParam()
+				.AddOption("read-window", 'W', "read small files ahead in on-disk order, keeping up to specified size in memory").SetValidator(ValidSize)
 				.Last()
 			.AddOption("client", 'n', "start backup client. All data will be send to stdout").SetGroup("command")
 				.AddSuboption("root", 'R', "search files starting from this folder").SetDefault(get_current_dir_name())
@@ -684,6 +1845,10 @@ int main(int argc, const char *argv[]) {
 					.AddSuboption("backup-hook-execute", '>', "script name to execute").SetRequired()
 					.Last()
 				.AddOption("exclude", 'X', "exclude files from backup").SetMultiple().SetParam()
+				.AddOption("include", 'A', "back up files matching pattern even if --exclude or --rules excludes them or their directory").SetMultiple().SetParam()
+				.AddOption("rules", 'u', "read exclude and include rules from file, compression rules are ignored by client").SetParam()
+				.AddOption("walk-threads", 'w', "read directories using specified number of threads").SetParam()
+				.AddOption("read-window", 'W', "read small files ahead in on-disk order, keeping up to specified size in memory").SetValidator(ValidSize)
 				.Last()
 			.AddOption("server", 's', "start backup server. All data will be got from stdin").SetGroup("command").SetParam()
 				.AddSuboption("slice", 'S', "set slice size").SetDefault("100M").SetValidator(ValidSize)
@@ -693,23 +1858,81 @@ int main(int argc, const char *argv[]) {
 				.AddOption("copy-data", 'C', "copy data from prev backup into new")
 				.AddOption("ref-execute", 'F', "execute command to get base slice if it missed")
 				.AddOption("save-listing", 'S', "keep new listing file").SetParam()
+				.AddOption("threads", 't', "compress data using specified number of threads").SetParam()
+				.AddOption("codec", 'z', "compress data using gzip (default), zstd or lz4").SetParam()
+				.AddOption("level", 'Z', "compression level for selected codec").SetParam()
+				.AddOption("adaptive", 'a', "choose compression level for every file by compressing its first bytes")
+				.AddOption("checkpoint", 'k', "make random access point inside large files every specified size").SetValidator(ValidSize)
+				.AddOption("dictionary", 'y', "compress small files with shared dictionary: 'auto' to build it from first files or dictionary file name (not readable by older isptar versions, gzip or tar)").SetParam()
+				.AddOption("binary-listing", 'b', "write compact binary listing (not readable by older isptar versions)")
 				.Last()
 			.AddOption("isolate", 'i', "extract cataloge from archive").SetParam().SetGroup("command")
 			.AddOption("merge", 'm', "merge archives into one file").SetParam().SetGroup("command")
 				.AddSuboption("slice", 'S', "set slice size").SetDefault("1T").SetValidator(ValidSize)
 				.AddOption("ref-execute", 'F', "execute command to get base slice if it missed").SetParam()
 				.AddOption("save-listing", 'S', "keep new listing file").SetParam()
+				.AddOption("threads", 't', "compress data using specified number of threads").SetParam()
+				.AddOption("codec", 'z', "compress data using gzip (default), zstd or lz4").SetParam()
+				.AddOption("level", 'Z', "compression level for selected codec").SetParam()
+				.AddOption("adaptive", 'a', "choose compression level for every file by compressing its first bytes")
+				.AddOption("checkpoint", 'k', "make random access point inside large files every specified size").SetValidator(ValidSize)
+				.AddOption("dictionary", 'y', "compress small files with shared dictionary: 'auto' to build it from first files or dictionary file name (not readable by older isptar versions, gzip or tar)").SetParam()
+				.AddOption("binary-listing", 'b', "write compact binary listing (not readable by older isptar versions)")
+				.AddOption("raw", 'w', "copy compressed file data without recompression")
+				.Last()
+			.AddOption("consolidate", 'g', "make full archive from incremental one. Archive and all its bases are command line arguments").SetParam().SetGroup("command")
+				.AddSuboption("slice", 'S', "set slice size").SetDefault("100M").SetValidator(ValidSize)
+				.AddOption("ref-execute", 'F', "execute command to get source slice if it missed").SetParam()
+				.AddOption("save-listing", 'S', "keep new listing file").SetParam()
+				.AddOption("raw", 'w', "copy compressed file data without recompression")
+				.AddOption("threads", 't', "compress data using specified number of threads").SetParam()
+				.AddOption("codec", 'z', "compress data using gzip (default), zstd or lz4").SetParam()
+				.AddOption("level", 'Z', "compression level for selected codec").SetParam()
+				.AddOption("adaptive", 'a', "choose compression level for every file by compressing its first bytes")
+				.AddOption("checkpoint", 'k', "make random access point inside large files every specified size").SetValidator(ValidSize)
+				.AddOption("dictionary", 'y', "compress small files with shared dictionary: 'auto' to build it from first files or dictionary file name (not readable by older isptar versions, gzip or tar)").SetParam()
+				.AddOption("binary-listing", 'b', "write compact binary listing (not readable by older isptar versions)")
 				.Last()
 			.AddOption("split", 'p', "split archive merged by '--merge'. You can specify new archive name prefix as last command line argument").SetParam().SetGroup("command")
 				.AddSuboption("slice", 'S', "set slice size").SetDefault("1T").SetValidator(ValidSize)
 				.AddOption("ref-execute", 'F', "execute command to get base slice if it missed").SetParam()
 				.AddOption("save-listing", 'S', "keep new listing file").SetParam()
 				.AddOption("single-part", '1', "save new arhive in single part")
+				.AddOption("threads", 't', "compress data using specified number of threads").SetParam()
+				.AddOption("codec", 'z', "compress data using gzip (default), zstd or lz4").SetParam()
+				.AddOption("level", 'Z', "compression level for selected codec").SetParam()
+				.AddOption("adaptive", 'a', "choose compression level for every file by compressing its first bytes")
+				.AddOption("checkpoint", 'k', "make random access point inside large files every specified size").SetValidator(ValidSize)
+				.AddOption("dictionary", 'y', "compress small files with shared dictionary: 'auto' to build it from first files or dictionary file name (not readable by older isptar versions, gzip or tar)").SetParam()
+				.AddOption("binary-listing", 'b', "write compact binary listing (not readable by older isptar versions)")
+				.Last()
+			.AddOption("reslice", 'o', "copy archive into slices of another size. New archive name is the last command line argument").SetParam().SetGroup("command")
+				.AddSuboption("slice", 'S', "set slice size").SetRequired().SetValidator(ValidSize)
+				.AddOption("ref-execute", 'F', "execute command to get source slice if it missed").SetParam()
+				.AddOption("save-listing", 'S', "keep new listing file").SetParam()
 				.Last();
 
 		args.Parse(argc, argv);
 
 		const std::string command = args["command"];
+		if (args->Has("io-buffer"))
+			io::SetBufferSize(misc::Int(args["io-buffer"]));
+		io::SetDropCache(args->Has("no-cache") || args->Has("direct-io"));
+		io::SetDirectWrite(args->Has("direct-io"));
+		PackOptions pack;
+		if (args->Has("codec"))
+			pack.codec = args["codec"];
+		if (args->Has("level"))
+			pack.level = misc::Int(args["level"]);
+		if (args->Has("threads"))
+			pack.threads = misc::Int(args["threads"]);
+		pack.adaptive = args->Has("adaptive");
+		if (args->Has("checkpoint"))
+			pack.checkpoint = misc::Int(args["checkpoint"]);
+		if (args->Has("dictionary"))
+			pack.dictionary = args["dictionary"];
+		if (args->Has("binary-listing"))
+			pack.listing = LISTING_BINARY;
 		if (command == "merge") {
 			if (args->ArgsCount() < 1)
 				args.Usage();
@@ -717,17 +1940,23 @@ int main(int argc, const char *argv[]) {
 			slice::OStream out(args["merge"], misc::Int(args["slice"]));
 			if (args->Has("execute"))
 				out.SetUpload(args["execute"]);
-			TarSender sender(args["merge"], out, args->Param("save-listing"));
+			if (args->Has("upload-jobs"))
+				out.SetUploadJobs(misc::Int(args["upload-jobs"]));
+			TarSender sender(args["merge"], out, args->Param("save-listing"), pack);
+			const bool raw = args->Has("raw") && pack.codec == "gzip";
 			unsigned int arg = 0;
 			std::string parts;
 			int id = 1;
 			while (arg < args->ArgsCount()) {
 				TarReader reader(args->Args(arg), "", args->Param("ref-execute"));
+				if (args->Has("prefetch"))
+					reader.SetPrefetch(misc::Int(args["prefetch"]));
 				for (++arg; arg < args->ArgsCount() && args->Args(arg)[0] != ':'; ++arg)
 					reader.AddBase(args->Args(arg));
 				while (reader.Read())
-					if (sender.SendInfo(reader.info()))
-						sender.SendData(reader.data());
+					if (sender.SendInfo(reader.info()) && !(raw && sender.SendMember(
+							[&reader](io::OStream &out) { return reader.CopyMember(out); }, reader.Offset())))
+						sender.SendData(reader.data(), GetAttr(reader.Offset(), "s"));
 				if (arg < args->ArgsCount()) {
 					tar::FileInfo info;
 					info.filename = PART_NAME_PREFIX + misc::Str(id++);
@@ -745,8 +1974,48 @@ int main(int argc, const char *argv[]) {
 			}
 			sender.WriteFooter(parts);
 			out.Finish();
+		} else if (command == "consolidate") {
+			if (args->ArgsCount() < 1)
+				args.Usage();
+			TarReader reader(args->Args(0), "", args->Param("ref-execute"));
+			if (args->Has("prefetch"))
+				reader.SetPrefetch(misc::Int(args["prefetch"]));
+			for (unsigned int arg = 1; arg < args->ArgsCount(); ++arg)
+				reader.AddBase(args->Args(arg));
+			slice::OStream out(args["consolidate"], misc::Int(args["slice"]));
+			if (args->Has("execute"))
+				out.SetUpload(args["execute"]);
+			if (args->Has("upload-jobs"))
+				out.SetUploadJobs(misc::Int(args["upload-jobs"]));
+			TarSender sender(args["consolidate"], out, args->Param("save-listing"), pack);
+			Consolidator(reader, sender, args->Has("raw") && pack.codec == "gzip").Run();
+			sender.WriteFooter();
+			out.Finish();
+		} else if (command == "reslice") {
+			if (args->ArgsCount() != 1)
+				args.Usage();
+			slice::IStream in(args["reslice"]);
+			if (args->Has("ref-execute"))
+				in.SetDownload(args["ref-execute"]);
+			if (args->Has("prefetch"))
+				in.SetPrefetch(misc::Int(args["prefetch"]));
+			slice::OStream out(args->Args(0), misc::Int(args["slice"]));
+			if (args->Has("execute"))
+				out.SetUpload(args["execute"]);
+			if (args->Has("upload-jobs"))
+				out.SetUploadJobs(misc::Int(args["upload-jobs"]));
+			auto head = gzip::GetHeader(in);
+			if (head.empty())
+				throw std::runtime_error("No header found");
+			pack.codec = head["codec"].empty() ? "gzip" : head["codec"];
+			pack.listing = listing::Version(head);
+			TarSender sender(args->Args(0), out, args->Param("save-listing"), pack);
+			Reslicer(in, out, misc::Int(args["slice"])).Run(sender, head);
+			out.Finish();
 		} else if (command == "split") {
 			TarReader reader(args["split"], "", args->Param("ref-execute"));
+			if (args->Has("prefetch"))
+				reader.SetPrefetch(misc::Int(args["prefetch"]));
 			std::string parts = reader.Header("parts");
 			if (parts.empty())
 				throw std::runtime_error("No parts found");
@@ -763,12 +2032,14 @@ int main(int argc, const char *argv[]) {
 				slice::OStream out(filename, misc::Int(args["slice"]));
 				if (args->Has("execute"))
 					out.SetUpload(args["execute"]);
+				if (args->Has("upload-jobs"))
+					out.SetUploadJobs(misc::Int(args["upload-jobs"]));
 				TarSender sender(filename, out,
 					args->Has("save-listing")
 						? args->Has("single-part")
 							? args->Param("save-listing")
 							: args->Param("save-listing") + name
-						: "");
+						: "", pack);
 				while (reader.Read())
 					if (reader.info().filename.compare(0, sizeof(PART_NAME_PREFIX) - 1, PART_NAME_PREFIX) == 0) {
 						if (reader.info().linkname != PART_DEST_PREFIX + name)
@@ -779,7 +2050,7 @@ int main(int argc, const char *argv[]) {
 						else
 							break;
 					} else if (sender.SendInfo(reader.info()))
-						sender.SendData(reader.data());
+						sender.SendData(reader.data(), GetAttr(reader.Offset(), "s"));
 				sender.WriteFooter();
 				out.Finish();
 			}
@@ -788,35 +2059,56 @@ int main(int argc, const char *argv[]) {
 				args->Has("listing") ? args["listing"] : "",
 				args->Has("execute") ? args["execute"] : ""
 			);
+			if (args->Has("prefetch"))
+				reader.SetPrefetch(misc::Int(args["prefetch"]));
 			for (size_t i = 0; i < args->ParamCount("base"); ++i)
 				reader.AddBase(args->Param("base", i));
 			const std::string root = args["root"];
+			args::StringVector paths = args->Args();
+			if (args->Has("files-from"))
+				ReadPaths(args["files-from"], paths);
+			ListingFilter filter(reader, paths);
 			if (args["dest"] == "root") {
 				if (args->Has("user"))
 					SetEUid(args["user"]);
-				while (reader.Read())
-					if (CheckName(args->Args(), reader.info().filename)) try {
-						if (reader.info().type == REGTYPE && reader.info().size > 0)
-							reader.info().Create(root, reader.data());
-						else
+				std::unique_ptr<ParallelExtract> parallel;
+				if (args->Has("threads"))
+					parallel.reset(new ParallelExtract(reader, misc::Int(args["threads"])));
+				std::unique_ptr<OrderedExtract> ordered;
+				if (args->Has("physical-order"))
+					ordered.reset(new OrderedExtract);
+				while (filter.Next())
+					if (CheckPath(reader.info().filename)) try {
+						if (ordered && ordered->Add(reader.info(), reader.Offset()))
+							continue;
+						if (reader.info().type != REGTYPE || reader.info().size == 0)
 							reader.info().Create(root);
+						else if (parallel)
+							parallel->Add(reader.info(), reader.Offset(), reader.info().Create(root));
+						else
+							reader.info().Create(root, reader.data(), GetAttr(reader.Offset(), "s"));
 					} catch (const slice::error &) {
 						throw;
 					} catch (const std::exception &e) {
 						std::cerr << reader.info().filename << '\t' << e.what() << std::endl;
 					}
+				if (ordered)
+					ordered->Finish(reader, root, parallel.get());
+				if (parallel)
+					parallel->Finish();
 			} else if (args["dest"] == "list-only") {
-				while (reader.Read())
-					if (CheckName(args->Args(), reader.info().filename))
+				while (filter.Next())
+					if (CheckPath(reader.info().filename))
 						std::cout << reader.info().Str() << std::endl;
 			} else {
-				io::FileOStream out(args["tar"]);
+				io::FileOStream file(args["tar"]);
+				io::BufferedOStream out(file);
 				gzip::OStream gz_out(out);
 				tar::Writer tar(gz_out);
 				bool plain_done = false;
 				std::string plain_file = args->Param("plain-file");
-				while (reader.Read())
-					if (CheckName(args->Args(), reader.info().filename)) {
+				while (filter.Next())
+					if (CheckPath(reader.info().filename)) {
 						if (plain_done) {
 							plain_done = false;
 							io::FileIStream in(args["plain-file"]);
@@ -827,7 +2119,12 @@ int main(int argc, const char *argv[]) {
 						if (reader.info().type == REGTYPE) {
 							if (!plain_file.empty()) {
 								io::FileOStream out(plain_file);
-								if (reader.info().size > 0)
+								if (reader.info().size > 0 && args->Has("range")) {
+									std::string range = args["range"];
+									int64_t offset = std::min(misc::Int(misc::GetWord(range, ':')), (int64_t)reader.info().size);
+									LIStream part(reader.data(offset), range.empty() ? reader.info().size : misc::Int(range));
+									out.WriteStream(part);
+								} else if (reader.info().size > 0)
 									out.WriteStream(reader.data());
 								plain_done = true;
 							} else if (reader.info().size > 0)
@@ -840,6 +2137,7 @@ int main(int argc, const char *argv[]) {
 				} else {
 					tar.WriteTail(true);
 					gz_out.Flush(true);
+					out.Flush();
 				}
 			}
 		} else if (command == "isolate") {
@@ -867,17 +2165,30 @@ int main(int argc, const char *argv[]) {
 			int64_t listing_size = misc::Int(head["listing_size"]);
 			in.Seek(0, -(listing_size + misc::Int(head["header_size"])), SEEK_END);
 			gzip::IStream listing(in, listing_size);
-			int size;
-			char buf[CHUNK];
-			while ((size = listing.Read(buf, sizeof(buf))) > 0)
-				std::cout.write(buf, size);
+			if (listing::Version(head) == LISTING_TEXT) {
+				int size;
+				char buf[CHUNK];
+				while ((size = listing.Read(buf, sizeof(buf))) > 0)
+					std::cout.write(buf, size);
+			} else {
+				listing::Reader reader(listing, LISTING_BINARY);
+				tar::FileInfo info;
+				std::string offs;
+				while (reader.Read(info, offs))
+					std::cout << listing::Line(info, offs) << '\n';
+				std::cout << '\n';
+			}
 		} else if (command == "client") {
 			if (!args->ArgsCount())
 				args.Usage();
 			PipeSender sender;
-			Reader reader(sender, args->Params("exclude"));
+			Reader reader(sender, GetRules(args));
 			if (args->Has("backup-hook"))
 				reader.SetBackupHook(args["backup-hook"], args["backup-hook-execute"]);
+			if (args->Has("walk-threads"))
+				reader.SetWalkThreads(misc::Int(args["walk-threads"]));
+			if (args->Has("read-window"))
+				reader.SetReadWindow(misc::Int(args["read-window"]));
 			const std::string root = args["root"];
 			if (args->Has("user"))
 				SetEUid(args["user"]);
@@ -888,8 +2199,10 @@ int main(int argc, const char *argv[]) {
 			slice::OStream out(args["server"], misc::Int(args["slice"]));
 			if (args->Has("execute"))
 				out.SetUpload(args["execute"]);
+			if (args->Has("upload-jobs"))
+				out.SetUploadJobs(misc::Int(args["upload-jobs"]));
 			TarSender sender(args["server"], out,
-				args->Has("save-listing") ? args["save-listing"] : "");
+				args->Has("save-listing") ? args["save-listing"] : "", pack);
 			if (args->Has("base")) {
 				auto base = new TarReader(args["base"],
 					args->Has("listing") ? args["listing"] : "",
@@ -917,8 +2230,10 @@ int main(int argc, const char *argv[]) {
 			slice::OStream out(args["create"], misc::Int(args["slice"]));
 			if (args->Has("execute"))
 				out.SetUpload(args["execute"]);
+			if (args->Has("upload-jobs"))
+				out.SetUploadJobs(misc::Int(args["upload-jobs"]));
 			TarSender sender(args["create"], out,
-				args->Has("save-listing") ? args["save-listing"] : "");
+				args->Has("save-listing") ? args["save-listing"] : "", pack);
 			if (args->Has("base")) {
 				auto base = new TarReader(args["base"],
 					args->Has("listing") ? args["listing"] : "",
@@ -926,9 +2241,13 @@ int main(int argc, const char *argv[]) {
 				);
 				sender.SetSource(base, !args->Has("copy-data"));
 			}
-			Reader reader(sender, args->Params("exclude"));
+			Reader reader(sender, GetRules(args));
 			if (args->Has("backup-hook"))
 				reader.SetBackupHook(args["backup-hook"], args["backup-hook-execute"]);
+			if (args->Has("walk-threads"))
+				reader.SetWalkThreads(misc::Int(args["walk-threads"]));
+			if (args->Has("read-window"))
+				reader.SetReadWindow(misc::Int(args["read-window"]));
 			const std::string root = args["root"];
 			if (args->Has("user"))
 				SetEUid(args["user"]);
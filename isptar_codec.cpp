@@ -0,0 +1,65 @@
+#include "isptar_codec.h"
+#include "isptar_gzip.h"
+#ifdef HAVE_ZSTD
+#include "isptar_zstd.h"
+#endif
+#ifdef HAVE_LZ4
+#include "isptar_lz4.h"
+#endif
+#include <stdexcept>
+
+namespace codec {
+static std::runtime_error Unknown(const string &name) {
+	return std::runtime_error("Unsupported codec '" + name + "'");
+}
+
+IStreamPtr CreateIStream(const string &name, io::IStream &in, int64_t limit) {
+	if (name.empty() || name == "gzip")
+		return IStreamPtr(new gzip::IStream(in, limit));
+#ifdef HAVE_ZSTD
+	if (name == "zstd")
+		return IStreamPtr(new zstd::IStream(in, limit));
+#endif
+#ifdef HAVE_LZ4
+	if (name == "lz4")
+		return IStreamPtr(new lz4::IStream(in, limit));
+#endif
+	throw Unknown(name);
+}
+
+OStreamPtr CreateOStream(const string &name, io::OStream &out, int level, int threads) {
+	if (level == -1)
+		level = DefaultLevel(name);
+	if (name == "gzip")
+		return OStreamPtr(new gzip::OStream(out, level, threads));
+#ifdef HAVE_ZSTD
+	if (name == "zstd")
+		return OStreamPtr(new zstd::OStream(out, level, threads));
+#endif
+#ifdef HAVE_LZ4
+	if (name == "lz4") {
+		// сжатие lz4 однопоточное, --threads для него не молча игнорируем
+		if (threads > 1)
+			throw std::runtime_error("Codec lz4 does not support --threads");
+		return OStreamPtr(new lz4::OStream(out, level));
+	}
+#endif
+	throw Unknown(name);
+}
+
+int DefaultLevel(const string &name) {
+	if (name == "gzip")
+		return 9;
+	if (name == "zstd")
+		return 3;
+	if (name == "lz4")
+		return 1;
+	throw Unknown(name);
+}
+
+int FastLevel(const string &name) {
+	if (name == "gzip" || name == "zstd" || name == "lz4")
+		return 1;
+	throw Unknown(name);
+}
+} // end of codec namespace
@@ -0,0 +1,62 @@
+#ifndef __ISPTAR_CODEC_H__
+#define __ISPTAR_CODEC_H__
+#include "isptar_io.h"
+#include <functional>
+#include <stdexcept>
+#define	DEFAULT_CODEC	"gzip"
+
+/**
+ * Общий интерфейс упаковщиков данных архива. Каждый файл пакуется в отдельный
+ * независимый member (frame), который можно распаковать с начала, зная только
+ * его смещение в архиве
+ */
+namespace codec {
+using std::string;
+
+class IStream : public io::IStream {
+public:
+	virtual void Reset(int64_t limit = -1) = 0;
+	/// начать распаковку с контрольной точки внутри member (см. OStream::Checkpoint)
+	virtual void Resume(int64_t = -1) {
+		throw std::runtime_error("Checkpoints are not supported by codec");
+	}
+	/// словарь для следующих member, пустой отключает
+	virtual void SetDictionary(const string &dict) {
+		if (!dict.empty())
+			throw std::runtime_error("Dictionaries are not supported by codec");
+	}
+};
+
+class OStream : public io::OStream {
+public:
+	/// смещение от начала текущего member
+	virtual int64_t Offset() = 0;
+	/// finish завершает текущий member, иначе только выталкивает данные
+	virtual void Flush(bool finish) = 0;
+	/// уровень 0 означает самый дешевый режим (без сжатия, если кодек умеет)
+	virtual void SetLevel(int level) = 0;
+	/**
+	 * Начать внутри member участок, который распаковывается без предыдущих
+	 * данных. false, если кодек так не умеет. Позицию точки в выходном потоке
+	 * нужно брать через Mark
+	 */
+	virtual bool Checkpoint() { return false; }
+	/// словарь для следующих member, пустой отключает. false, если кодек не умеет
+	virtual bool SetDictionary(const string &) { return false; }
+	/// выполнить fn, когда все ранее записанные данные окажутся в выходном потоке
+	virtual void Mark(const std::function<void()> &fn) { fn(); }
+	/// дождаться записи всех данных в выходной поток
+	virtual void Sync() {}
+	virtual int64_t TotalOut() const = 0;
+};
+
+typedef std::shared_ptr<IStream> IStreamPtr;
+typedef std::shared_ptr<OStream> OStreamPtr;
+
+IStreamPtr CreateIStream(const string &name, io::IStream &in, int64_t limit = -1);
+OStreamPtr CreateOStream(const string &name, io::OStream &out, int level = -1, int threads = 0);
+int DefaultLevel(const string &name);
+int FastLevel(const string &name);
+} // end of codec namespace
+
+#endif
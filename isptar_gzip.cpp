@@ -1,14 +1,161 @@
 #include "isptar_gzip.h"
+#include "isptar_thread.h"
 #include <stdexcept>
 #include <assert.h>
+#include <string.h>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define	HAVE_PCLMUL
+#endif
 #define	MIN_TAILSIZE	20
 #define	MAX_TAILSIZE	39
+#define	BLOCK_SIZE		(1024 * 1024)
+#define	WINDOW_SIZE		32768
+#define	OS_CODE			3
+#define	STORED_BLOCK	65535
+#define	STORE_BUFFER	(1024 * 1024)
+#define	COPY_BUFFER		(64 * 1024)
+/// zlib считает размеры в uInt
+#define	ZLIB_MAX_SIZE	(1 << 30)
+#define	FOOTER_VERSION	1
+#define	FOOTER_DATA		28
+#define	FOOTER_HEAD		16
+#define	FOOTER_SIZE		(FOOTER_HEAD + FOOTER_DATA + 10)
 
 namespace gzip {
+#ifdef HAVE_PCLMUL
+/**
+ * CRC32 свёрткой через умножение без переносов (Intel, "Fast CRC Computation
+ * Using PCLMULQDQ Instruction"). len >= 64 и кратна 16, crc инвертирован
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t Crc32Fold(const unsigned char *buf, size_t len, uint32_t crc) {
+	static const uint64_t __attribute__((aligned(16))) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+	static const uint64_t __attribute__((aligned(16))) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+	static const uint64_t __attribute__((aligned(16))) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+	static const uint64_t __attribute__((aligned(16))) poly[] = { 0x01db710641, 0x01f7011641 };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((__m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((__m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((__m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((__m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((__m128i *)k1k2);
+	buf += 64;
+	len -= 64;
+
+	// по 64 байта в четыре потока
+	for (; len >= 64; buf += 64, len -= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((__m128i *)(buf + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((__m128i *)(buf + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((__m128i *)(buf + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((__m128i *)(buf + 0x30)));
+	}
+
+	// сводим четыре потока в один
+	x0 = _mm_load_si128((__m128i *)k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	for (; len >= 16; buf += 16, len -= 16) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((__m128i *)buf)), x5);
+	}
+
+	// 128 -> 64 бита
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x0 = _mm_loadl_epi64((__m128i *)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// редукция Барретта до 32 бит
+	x0 = _mm_load_si128((__m128i *)poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return _mm_extract_epi32(x1, 1);
+}
+
+static bool HasPclmul() {
+	unsigned eax, ebx, ecx, edx;
+	return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+}
+#endif
+
+uLong Crc32(uLong crc, const char *buf, size_t size) {
+#ifdef HAVE_PCLMUL
+	static const bool pclmul = HasPclmul();
+	if (pclmul && size >= 64) {
+		size_t len = size & ~(size_t)15;
+		crc = ~Crc32Fold((const unsigned char *)buf, len, ~crc) & 0xFFFFFFFF;
+		buf += len;
+		size -= len;
+	}
+#endif
+	return size ? crc32(crc, (const Bytef *)buf, size) : crc;
+}
+
+static string Header(int level, int strategy) {
+	const char header[10] = { '\x1f', '\x8b', Z_DEFLATED, 0, 0, 0, 0, 0,
+		(char)(level == 9 ? 2 : strategy >= Z_HUFFMAN_ONLY || level < 2 ? 4 : 0),
+		OS_CODE };
+	return string(header, sizeof(header));
+}
+
+static string Trailer(uLong crc, int64_t size) {
+	char tail[8];
+	for (int i = 0; i < 4; ++i) {
+		tail[i] = (crc >> (i * 8)) & 0xFF;
+		tail[i + 4] = (size >> (i * 8)) & 0xFF;
+	}
+	return string(tail, sizeof(tail));
+}
+
+/// оформить данные в stored блоки deflate, last помечает последний блок
+static void Frame(const char *buf, size_t size, bool last, string &out) {
+	do {
+		size_t len = std::min(size, (size_t)STORED_BLOCK);
+		const char head[5] = { (char)(last && len == size), (char)(len & 0xFF), (char)(len >> 8),
+			(char)(~len & 0xFF), (char)((~len >> 8) & 0xFF) };
+		out.append(head, sizeof(head));
+		out.append(buf, len);
+		buf += len;
+		size -= len;
+	} while (size > 0);
+}
+
 IStream::IStream(io::IStream &in, int64_t limit)
 	: m_in(in)
 	, m_limit(limit)
-	, m_current_pos(0) {
+	, m_current_pos(0)
+	, m_skip(0)
+	, m_buf(io::BufferSize())
+	, m_read(CHUNK) {
 	m_strm.zalloc = Z_NULL;
 	m_strm.zfree = Z_NULL;
 	m_strm.opaque = Z_NULL;
@@ -23,28 +170,57 @@ void IStream::Reset(int64_t limit) {
 	m_limit = limit;
 	m_current_pos = 0;
 	m_strm.avail_in = 0;
-	if (inflateReset(&m_strm) != Z_OK)
+	m_skip = 0;
+	m_read = CHUNK;
+	if (m_dict.empty()) {
+		if (inflateReset2(&m_strm, 15 + 16) != Z_OK)
+			throw std::runtime_error("Failed to reset zlib state");
+		return;
+	}
+	// заголовок такого member пишет OStream::Start, он всегда фиксированной длины
+	m_skip = Header(0, Z_DEFAULT_STRATEGY).size();
+	if (inflateReset2(&m_strm, -15) != Z_OK ||
+		inflateSetDictionary(&m_strm, (const Bytef *)m_dict.data(), m_dict.size()) != Z_OK)
 		throw std::runtime_error("Failed to reset zlib state");
 }
 
-int IStream::Read(char *buf, int size) {
+void IStream::Resume(int64_t limit) {
+	m_limit = limit;
+	m_current_pos = 0;
+	m_strm.avail_in = 0;
+	m_skip = 0;
+	m_read = CHUNK;
+	if (inflateReset2(&m_strm, -15) != Z_OK)
+		throw std::runtime_error("Failed to reset zlib state");
+}
+
+void IStream::SetDictionary(const string &dict) { m_dict = dict; }
+
+int64_t IStream::Read(char *buf, int64_t size) {
+	size = std::min(size, (int64_t)ZLIB_MAX_SIZE);
 	m_strm.avail_out = size;
 	m_strm.next_out = (unsigned char *)buf;
 
 	while (m_strm.avail_out > 0) {
 		if (!m_strm.avail_in) {
-			m_strm.next_in = m_buf;
-			int len = m_limit == -1 || (int)m_limit > (int)sizeof(m_buf)
-				? sizeof(m_buf)
-				: m_limit;
-			int have = m_in.Read((char *)m_buf, len);
-			m_strm.avail_in = have;
+			m_strm.next_in = &m_buf[0];
+			int64_t len = m_limit == -1 ? m_read : std::min((int64_t)m_read, m_limit);
+			m_read = std::min(m_read * 2, m_buf.size());
+			int64_t have = m_in.Read((char *)&m_buf[0], len);
 			if (have == -1)
 				throw std::runtime_error("Failed to get input");
+			m_strm.avail_in = have;
 			if (m_strm.avail_in == 0)
 				break;// size - m_strm.avail_out;
 			if (m_limit != -1)
 				m_limit -= m_strm.avail_in;
+			if (m_skip) {
+				int len = std::min(m_skip, (int)m_strm.avail_in);
+				m_strm.next_in += len;
+				m_strm.avail_in -= len;
+				m_skip -= len;
+				continue;
+			}
 		}
 		int res = inflate(&m_strm, Z_NO_FLUSH);
 		if (res > Z_OK)
@@ -52,7 +228,7 @@ int IStream::Read(char *buf, int size) {
 		if (res < Z_OK)
 			throw std::runtime_error("Failed to extract");
 	}
-	int res = size - m_strm.avail_out;
+	int64_t res = size - m_strm.avail_out;
 	m_current_pos += res;
 	return res;
 }
@@ -71,47 +247,368 @@ void IStream::Seek(int64_t pos) {
 	}
 }
 
-OStream::OStream(io::OStream &out, int level)
+/**
+ * Параллельная упаковка в стиле pigz: member режется на блоки по BLOCK_SIZE,
+ * каждый блок сжимается отдельно как raw deflate со словарем из последних
+ * WINDOW_SIZE байт предыдущего блока и выравнивается Z_SYNC_FLUSH. Заголовок
+ * и хвост gzip (crc32 и размер) дописываются при выводе блоков по порядку
+ */
+class OStream::Parallel {
+public:
+	Parallel(io::OStream &out, int level, int threads)
+		: m_out(out)
+		, m_pool(new thread::Pool(threads))
+		, m_level(level)
+		, m_strategy(Z_DEFAULT_STRATEGY)
+		, m_first(true)
+		, m_crc(0)
+		, m_size(0) {}
+
+	~Parallel() {
+		m_pool.reset();
+		ForEachI(m_free, strm) {
+			deflateEnd(*strm);
+			delete *strm;
+		}
+	}
+
+	void Write(const char *buf, int64_t size) {
+		while (size > 0) {
+			int64_t len = std::min(size, (int64_t)(BLOCK_SIZE - m_in.size()));
+			m_in.append(buf, len);
+			buf += len;
+			size -= len;
+			if (m_in.size() == BLOCK_SIZE)
+				Submit(false);
+		}
+	}
+
+	void Flush(bool finish) {
+		if (finish) {
+			if (!Empty())
+				Submit(true);
+		} else if (!m_in.empty())
+			Submit(false);
+	}
+
+	void SetLevel(int level, int strategy) {
+		Flush(true);
+		m_level = level;
+		m_strategy = strategy;
+	}
+
+	void Mark(const std::function<void()> &fn) {
+		if (m_queue.empty()) {
+			fn();
+		} else {
+			BlockPtr block(new Block);
+			block->mark = fn;
+			m_queue.push_back(block);
+		}
+	}
+
+	void SetDictionary(const string &dict) { m_preset = dict; }
+
+	void Checkpoint() {
+		if (!m_in.empty())
+			Submit(false);
+		m_dict.clear();
+	}
+
+	void Sync() { Drain(0); }
+	bool Empty() const { return m_first && m_in.empty(); }
+
+private:
+	struct Block {
+		string in;
+		string out;
+		string dict;
+		int64_t size;
+		uLong crc;
+		int level;
+		int strategy;
+		bool first;
+		bool last;
+		std::future<void> done;
+		std::function<void()> mark;
+	};
+	typedef std::shared_ptr<Block> BlockPtr;
+
+	io::OStream &m_out;
+	std::unique_ptr<thread::Pool> m_pool;
+	std::mutex m_mutex;
+	std::vector<z_stream *> m_free;
+	std::deque<BlockPtr> m_queue;
+	string m_in;
+	string m_dict;
+	string m_preset;
+	int m_level;
+	int m_strategy;
+	bool m_first;
+	uLong m_crc;
+	int64_t m_size;
+
+	void Submit(bool last) {
+		BlockPtr block(new Block);
+		block->in.swap(m_in);
+		if (m_first)
+			m_dict = m_preset;
+		block->dict = m_dict;
+		block->level = m_level;
+		block->strategy = m_strategy;
+		block->first = m_first;
+		block->last = last;
+		if (last) {
+			m_dict.clear();
+		} else {
+			m_dict.append(block->in);
+			if (m_dict.size() > WINDOW_SIZE)
+				m_dict.erase(0, m_dict.size() - WINDOW_SIZE);
+		}
+		m_first = last;
+		block->done = m_pool->Add([this, block] { Pack(*block); });
+		m_queue.push_back(block);
+		Drain(m_pool->size() * 2);
+	}
+
+	void Pack(Block &block) {
+		if (block.level == 0) {
+			if (!block.in.empty() || block.last)
+				Frame(block.in.data(), block.in.size(), block.last, block.out);
+			block.size = block.in.size();
+			block.crc = Crc32(0, block.in.data(), block.in.size());
+			string().swap(block.in);
+			return;
+		}
+		z_stream *strm = NULL;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (!m_free.empty()) {
+				strm = m_free.back();
+				m_free.pop_back();
+			}
+		}
+		bool reset = strm;
+		if (!reset) {
+			strm = new z_stream;
+			strm->zalloc = Z_NULL;
+			strm->zfree = Z_NULL;
+			strm->opaque = Z_NULL;
+			if (deflateInit2(strm, block.level, Z_DEFLATED, -15, 9, block.strategy) != Z_OK) {
+				delete strm;
+				throw std::runtime_error("Failed to init zlib");
+			}
+		}
+		std::shared_ptr<z_stream> guard(strm, [this](z_stream *strm) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_free.push_back(strm);
+		});
+		if (reset && (deflateReset(strm) != Z_OK || deflateParams(strm, block.level, block.strategy) != Z_OK))
+			throw std::runtime_error("Failed to reset zlib state");
+		if (!block.dict.empty() &&
+			deflateSetDictionary(strm, (const Bytef *)block.dict.data(), block.dict.size()) != Z_OK)
+			throw std::runtime_error("Failed to set compression dictionary");
+		strm->avail_in = block.in.size();
+		strm->next_in = (unsigned char *)block.in.data();
+		unsigned char buf[CHUNK * 4];
+		do {
+			strm->avail_out = sizeof(buf);
+			strm->next_out = buf;
+			if (deflate(strm, block.last ? Z_FINISH : Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+				throw std::runtime_error("Failed to compress");
+			block.out.append((char *)buf, sizeof(buf) - strm->avail_out);
+		} while (strm->avail_out == 0);
+		assert(strm->avail_in == 0);
+		block.size = block.in.size();
+		block.crc = Crc32(0, block.in.data(), block.in.size());
+		string().swap(block.in);
+		string().swap(block.dict);
+	}
+
+	void Drain(size_t limit) {
+		while (!m_queue.empty()) {
+			BlockPtr block = m_queue.front();
+			if (!block->mark) {
+				if (m_queue.size() <= limit && !thread::Ready(block->done))
+					break;
+				block->done.get();
+				Output(*block);
+			}
+			m_queue.pop_front();
+			if (block->mark)
+				block->mark();
+		}
+	}
+
+	void Output(const Block &block) {
+		if (block.first) {
+			m_out.WriteStr(Header(block.level, block.strategy));
+			m_crc = crc32(0, Z_NULL, 0);
+			m_size = 0;
+		}
+		m_out.Write(block.out.data(), block.out.size());
+		m_crc = crc32_combine(m_crc, block.crc, block.size);
+		m_size += block.size;
+		if (block.last)
+			m_out.WriteStr(Trailer(m_crc, m_size));
+	}
+};
+
+OStream::OStream(io::OStream &out, int level, int threads)
 	: m_out(out)
 	, m_offset(0)
 	, m_total_out(0)
-	, m_empty(true) {
+	, m_empty(true)
+	, m_level(level)
+	, m_strategy(Z_DEFAULT_STRATEGY)
+	, m_store(level == 0)
+	, m_started(false)
+	, m_crc(0)
+	, m_size(0) {
+	if (threads > 0) {
+		m_parallel.reset(new Parallel(out, level, threads));
+		return;
+	}
 	m_strm.zalloc = Z_NULL;
 	m_strm.zfree = Z_NULL;
 	m_strm.opaque = Z_NULL;
-	if (deflateInit2(&m_strm, level, Z_DEFLATED, 31, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+	if (deflateInit2(&m_strm, level, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY) != Z_OK)
 		throw std::runtime_error("Failed to init zlib");
 }
 
-OStream::~OStream() { deflateEnd(&m_strm); }
+OStream::~OStream() {
+	if (!m_parallel)
+		deflateEnd(&m_strm);
+}
 
-void OStream::Write(const char *buf, int size) {
+void OStream::Write(const char *buf, int64_t size) {
+	for (; size > ZLIB_MAX_SIZE; buf += ZLIB_MAX_SIZE, size -= ZLIB_MAX_SIZE)
+		Write(buf, ZLIB_MAX_SIZE);
 	m_total_out += size;
-	Pack(buf, size, Z_NO_FLUSH);
+	if (m_parallel) {
+		m_parallel->Write(buf, size);
+	} else if (size > 0) {
+		Start();
+		m_crc = Crc32(m_crc, buf, size);
+		m_size += size;
+		if (!m_store) {
+			Pack(buf, size, Z_NO_FLUSH);
+		} else {
+			m_stored.append(buf, size);
+			if (m_stored.size() >= STORE_BUFFER)
+				Store(false);
+		}
+	}
 }
 
 int64_t OStream::Offset() {
+	if (m_parallel) {
+		if (!m_parallel->Empty())
+			throw std::runtime_error("Offset inside parallel gzip member is unknown");
+		return 0;
+	}
 	Flush(false);
 	return m_offset;
 }
 
+void OStream::Mark(const std::function<void()> &fn) {
+	if (m_parallel)
+		m_parallel->Mark(fn);
+	else
+		fn();
+}
+
+void OStream::Sync() {
+	if (m_parallel)
+		m_parallel->Sync();
+}
+
 void OStream::Flush(bool finish) {
-	if (finish) {
-		Pack(NULL, 0, Z_FINISH);
-		if (deflateReset(&m_strm) != Z_OK)
-			throw std::runtime_error("Failed to reset zlib state");
+	if (m_parallel) {
+		m_parallel->Flush(finish);
+	} else if (finish) {
+		if (!m_started)
+			return;
+		if (m_store) {
+			Store(true);
+		} else {
+			m_empty = false;
+			Pack(NULL, 0, Z_FINISH);
+			if (deflateReset(&m_strm) != Z_OK)
+				throw std::runtime_error("Failed to reset zlib state");
+		}
+		m_out.WriteStr(Trailer(m_crc, m_size));
+		m_started = false;
+		m_empty = true;
 		m_offset = 0;
+	} else if (m_store) {
+		if (!m_stored.empty())
+			Store(false);
 	} else {
 		Pack(NULL, 0, Z_SYNC_FLUSH); // записать данные и выровнить по границе байта
 	}
 }
 
+void OStream::SetLevel(int level) { SetLevel(level, Z_DEFAULT_STRATEGY); }
+
 void OStream::SetLevel(int level, int strategy) {
+	if (m_parallel)
+		return m_parallel->SetLevel(level, strategy);
 	Flush(true);
-	if (deflateParams(&m_strm, level, strategy) == Z_STREAM_ERROR)
+	m_level = level;
+	m_strategy = strategy;
+	m_store = level == 0;
+	if (!m_store && deflateParams(&m_strm, level, strategy) == Z_STREAM_ERROR)
 		throw std::runtime_error("Failed to set compressing level");
 }
 
+bool OStream::Checkpoint() {
+	if (m_parallel) {
+		if (m_parallel->Empty())
+			return false;
+		m_parallel->Checkpoint();
+	} else if (!m_started) {
+		return false;
+	} else if (m_store) {
+		if (!m_stored.empty())
+			Store(false);
+	} else {
+		m_empty = false;
+		Pack(NULL, 0, Z_FULL_FLUSH);
+	}
+	return true;
+}
+
+bool OStream::SetDictionary(const string &dict) {
+	if (m_parallel)
+		m_parallel->SetDictionary(dict);
+	else
+		m_dict = dict;
+	return true;
+}
+
+void OStream::Start() {
+	if (m_started)
+		return;
+	const string header = Header(m_level, m_strategy);
+	m_out.WriteStr(header);
+	m_offset += header.size();
+	m_started = true;
+	m_crc = crc32(0, Z_NULL, 0);
+	m_size = 0;
+	if (!m_store && !m_dict.empty() &&
+		deflateSetDictionary(&m_strm, (const Bytef *)m_dict.data(), m_dict.size()) != Z_OK)
+		throw std::runtime_error("Failed to set compression dictionary");
+}
+
+void OStream::Store(bool finish) {
+	m_framed.clear();
+	Frame(m_stored.data(), m_stored.size(), finish, m_framed);
+	m_stored.clear();
+	m_out.Write(m_framed.data(), m_framed.size());
+	m_offset += m_framed.size();
+}
+
 int64_t OStream::TotalOut() const { return m_total_out; }
 
 void OStream::Pack(const char *in, int size, int flush) {
@@ -124,7 +621,7 @@ void OStream::Pack(const char *in, int size, int flush) {
 
 	m_strm.avail_in = size;
 	m_strm.next_in = (unsigned char *)in;
-	unsigned char buf[CHUNK];
+	unsigned char buf[CHUNK * 4];
 	do {
 		m_strm.avail_out = sizeof(buf);
 		m_strm.next_out = buf;
@@ -160,8 +657,248 @@ string Pack(const string &data) {
 	return res;
 }
 
+bool DataEnd(io::IStream &in, int64_t size, DataTail &tail) {
+	z_stream strm;
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	strm.avail_in = 0;
+	strm.next_in = Z_NULL;
+	if (inflateInit2(&strm, 15 + 16) != Z_OK)
+		throw std::runtime_error("Failed to init zlib");
+	std::unique_ptr<z_stream, int(*)(z_streamp)> guard(&strm, inflateEnd);
+	std::vector<unsigned char> inbuf(COPY_BUFFER), outbuf(COPY_BUFFER);
+	int64_t read = 0;
+	tail.length = 0;
+	tail.bits = 0;
+	tail.last = 0;
+	tail.window.clear();
+	tail.rest.clear();
+	tail.crc = Crc32(0, NULL, 0);
+	while (true) {
+		if (strm.avail_in == 0) {
+			int len = in.Read((char *)&inbuf[0], inbuf.size());
+			if (len <= 0)
+				throw std::runtime_error("Unexpected end of member");
+			read += len;
+			strm.avail_in = len;
+			strm.next_in = &inbuf[0];
+		}
+		strm.avail_out = outbuf.size();
+		strm.next_out = &outbuf[0];
+		// Z_BLOCK: inflate останавливается на границах блоков
+		int ret = inflate(&strm, Z_BLOCK);
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+			throw std::runtime_error("Failed to extract");
+		int64_t have = outbuf.size() - strm.avail_out;
+		int64_t need = std::min(have, size - (int64_t)(strm.total_out - have));
+		tail.rest.append((const char *)&outbuf[0], need);
+		tail.crc = Crc32(tail.crc, (const char *)&outbuf[0], need);
+		if (ret == Z_STREAM_END && (int64_t)strm.total_out < size)
+			return false;
+		if ((strm.data_type & 128) && !(strm.data_type & 64) && (int64_t)strm.total_out <= size) {
+			// граница блока: начало member до нее копируется как есть
+			tail.length = read - strm.avail_in;
+			tail.bits = strm.data_type & 7 ? 8 - (strm.data_type & 7) : 0;
+			if (tail.bits) {
+				--tail.length;
+				tail.last = strm.next_in[-1] & ((1 << tail.bits) - 1);
+			}
+			tail.window.append(tail.rest);
+			if (tail.window.size() > WINDOW_SIZE)
+				tail.window.erase(0, tail.window.size() - WINDOW_SIZE);
+			tail.rest.clear();
+		}
+		if ((int64_t)strm.total_out >= size)
+			return tail.length > 0;
+	}
+}
+
+void CopyData(io::IStream &in, io::OStream &out, const DataTail &tail, int64_t size) {
+	std::vector<char> buf(COPY_BUFFER);
+	for (int64_t length = tail.length; length > 0; ) {
+		int len = in.Read(&buf[0], std::min(length, (int64_t)buf.size()));
+		if (len <= 0)
+			throw std::runtime_error("Unexpected end of member");
+		out.Write(&buf[0], len);
+		length -= len;
+	}
+	// остаток данных - последним блоком с теми же битами и окном, как в gzjoin
+	z_stream strm;
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		throw std::runtime_error("Failed to init zlib");
+	std::unique_ptr<z_stream, int(*)(z_streamp)> guard(&strm, deflateEnd);
+	if ((tail.bits && deflatePrime(&strm, tail.bits, tail.last) != Z_OK) ||
+			(!tail.window.empty() && deflateSetDictionary(&strm, (const Bytef *)tail.window.data(), tail.window.size()) != Z_OK))
+		throw std::runtime_error("Failed to init zlib");
+	strm.avail_in = tail.rest.size();
+	strm.next_in = (Bytef *)tail.rest.data();
+	int ret;
+	do {
+		strm.avail_out = buf.size();
+		strm.next_out = (Bytef *)&buf[0];
+		ret = deflate(&strm, Z_FINISH);
+		if (ret == Z_STREAM_ERROR)
+			throw std::runtime_error("Failed to compress");
+		out.Write(&buf[0], buf.size() - strm.avail_out);
+	} while (ret != Z_STREAM_END);
+	out.WriteStr(Trailer(tail.crc, size));
+}
+
+int LastMember(const string &data) {
+	z_stream strm;
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	if (inflateInit2(&strm, 15 + 16) != Z_OK)
+		throw std::runtime_error("Failed to init zlib");
+	unsigned char buf[CHUNK];
+	int res = -1;
+	for (int i = (int)data.size() - MIN_TAILSIZE; i >= 0 && res == -1; --i) {
+		if (data.compare(i, 3, "\x1f\x8b\x08") != 0)
+			continue;
+		if (inflateReset(&strm) != Z_OK)
+			throw std::runtime_error("Failed to reset zlib state");
+		strm.avail_in = data.size() - i;
+		strm.next_in = (unsigned char *)data.data() + i;
+		int ret;
+		do {
+			strm.avail_out = sizeof(buf);
+			strm.next_out = buf;
+			ret = inflate(&strm, Z_NO_FLUSH);
+		} while (ret == Z_OK && strm.avail_in > 0);
+		if (ret == Z_STREAM_END && strm.avail_in == 0)
+			res = i;
+	}
+	inflateEnd(&strm);
+	return res;
+}
+
+static string Unpack(const string &data) {
+	z_stream strm;
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	if (inflateInit2(&strm, 15 + 16) != Z_OK)
+		throw std::runtime_error("Failed to init zlib");
+	strm.avail_in = data.size();
+	strm.next_in = (unsigned char *)data.data();
+	unsigned char buf[CHUNK];
+	string res;
+	int ret;
+	do {
+		strm.avail_out = sizeof(buf);
+		strm.next_out = buf;
+		ret = inflate(&strm, Z_NO_FLUSH);
+		res.append((char *)buf, sizeof(buf) - strm.avail_out);
+	} while (ret == Z_OK);
+	inflateEnd(&strm);
+	if (ret != Z_STREAM_END)
+		throw std::runtime_error("Bad header");
+	return res;
+}
+
+/**
+ * Пустой gzip member, в поле FEXTRA которого (подполе "IT") лежат размеры
+ * listing и упакованного заголовка. Пишется между заголовком и последним
+ * member с размером заголовка, поэтому старые версии его просто пропускают
+ */
+static string FooterHead() {
+	const char head[FOOTER_HEAD] = { '\x1f', '\x8b', Z_DEFLATED, 4, 0, 0, 0, 0, 0, OS_CODE,
+		FOOTER_DATA + 4, 0, 'I', 'T', FOOTER_DATA, 0 };
+	return string(head, sizeof(head));
+}
+
+static void PutInt(string &out, uint64_t value, int size) {
+	for (int i = 0; i < size; ++i)
+		out.push_back((value >> (i * 8)) & 0xFF);
+}
+
+static uint64_t GetInt(const unsigned char *buf, int size) {
+	uint64_t res = 0;
+	for (int i = size - 1; i >= 0; --i)
+		res = (res << 8) | buf[i];
+	return res;
+}
+
+string Footer(int64_t listing_size, const string &packed_header) {
+	string data;
+	PutInt(data, FOOTER_VERSION, 2);
+	PutInt(data, 0, 2);
+	PutInt(data, listing_size, 8);
+	PutInt(data, packed_header.size(), 8);
+	PutInt(data, Crc32(0, packed_header.data(), packed_header.size()), 4);
+	PutInt(data, Crc32(0, data.data(), data.size()), 4);
+	assert(data.size() == FOOTER_DATA);
+	// пустой последний stored блок, crc и размер нулевые
+	const char tail[10] = { 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	return FooterHead() + data + string(tail, sizeof(tail));
+}
+
+static void ParseHeader(const string &header, int64_t header_size, std::map<string, string> &result) {
+	string::size_type start = 0;
+	for (auto pos = header.find('='); pos != string::npos; pos = header.find('=', start)) {
+		string name = header.substr(start, pos - start);
+		start = pos + 1;
+		pos = header.find('\n', start);
+		if (pos == string::npos)
+			break;
+		result[name] = header.substr(start, pos - start);
+		start = pos + 1;
+	}
+	result["header_size"] = misc::Str(header_size);
+}
+
+/// заголовок по footer фиксированного формата, false для старых архивов
+static bool GetFooterHeader(slice::IStream &in, std::map<string, string> &result) {
+	unsigned char tail[FOOTER_SIZE + MAX_TAILSIZE];
+	in.Seek(0, -(int64_t)sizeof(tail), SEEK_END);
+	// хвост может лежать в двух slice, тогда Read отдает его частями
+	int size = 0;
+	for (int res; size < (int)sizeof(tail) && (res = in.Read((char *)tail + size, sizeof(tail) - size)) > 0; )
+		size += res;
+	const string head = FooterHead();
+	for (int i = size - FOOTER_SIZE - MIN_TAILSIZE; i >= 0; --i) {
+		if (memcmp(tail + i, head.data(), head.size()) != 0)
+			continue;
+		const unsigned char *data = tail + i + FOOTER_HEAD;
+		// сигнатура может случайно встретиться в данных
+		if (GetInt(data + FOOTER_DATA - 4, 4) != Crc32(0, (const char *)data, FOOTER_DATA - 4))
+			continue;
+		if (GetInt(data, 2) > FOOTER_VERSION)
+			throw std::runtime_error("Unsupported archive footer version");
+		int64_t listing_size = GetInt(data + 4, 8);
+		int64_t packed_size = GetInt(data + 12, 8);
+		int64_t header_size = packed_size + (size - i);
+
+		in.Seek(0, -header_size, SEEK_END);
+		string packed(packed_size, '\0');
+		for (int64_t done = 0; done < packed_size; ) {
+			int res = in.Read(&packed[done], packed_size - done);
+			if (res <= 0)
+				throw std::runtime_error("Failed to read header");
+			done += res;
+		}
+		if (GetInt(data + 20, 4) != Crc32(0, packed.data(), packed.size()))
+			return false;
+		ParseHeader(Unpack(packed), header_size, result);
+		auto listing = result.find("listing_size");
+		if (listing == result.end())
+			result["listing_size"] = misc::Str(listing_size);
+		else if (misc::Int(listing->second) != listing_size)
+			throw std::runtime_error("Archive footer does not match header");
+		return true;
+	}
+	return false;
+}
+
 std::map<std::string, std::string> GetHeader(slice::IStream &in) {
 	std::map<std::string, std::string> result;
+	if (GetFooterHeader(in, result))
+		return result;
 	unsigned char inbuf[CHUNK];
 	in.Seek(0, -MAX_TAILSIZE, SEEK_END);
 	int size = in.Read((char *)inbuf, MAX_TAILSIZE);
@@ -1,49 +1,123 @@
 #include <zlib.h>
-#include "isptar_io.h"
+#include "isptar_codec.h"
 #include "isptar_slice.h"
 #include <map>
+#include <memory>
+#include <functional>
+#include <vector>
 
 namespace gzip {
 using std::string;
 
-class IStream : public io::IStream {
+class IStream : public codec::IStream {
 public:
 	IStream(io::IStream &in, int64_t limit = -1);
 	~IStream();
-	void Reset(int64_t limit = -1);
+	virtual void Reset(int64_t limit = -1);
+	virtual void Resume(int64_t limit = -1);
+	virtual void SetDictionary(const string &dict);
 
-	virtual int Read(char *buf, int size);
+	virtual int64_t Read(char *buf, int64_t size);
 	virtual void Seek(int64_t pos);
 private:
 	io::IStream &m_in;
 	int64_t m_limit;
 	int64_t m_current_pos;
 	z_stream m_strm;
-	unsigned char m_buf[CHUNK];
+	string m_dict;
+	int m_skip;
+	/**
+	 * после Reset вход читается порциями от CHUNK, каждая следующая вдвое
+	 * больше, пока не дойдет до размера буфера: мелкий файл не тянет за
+	 * собой лишние данные, а длинный читается крупными блоками
+	 */
+	std::vector<unsigned char> m_buf;
+	size_t m_read;
 
 	void Init();
 };
 
-class OStream : public io::OStream {
+/**
+ * При threads > 0 каждый gzip member упаковывается блоками в пуле потоков,
+ * а в m_out записывается в исходном порядке. Смещение внутри member в этом
+ * режиме известно только на его границе, поэтому действия, зависящие от
+ * позиции в m_out, нужно откладывать через Mark
+ *
+ * Члены пишутся как raw deflate с собственным заголовком gzip, чтобы можно
+ * было использовать общий словарь (SetDictionary). gzip без словаря такие
+ * member не распакует, поэтому словарь задается только явно
+ *
+ * Контрольная точка делается через Z_FULL_FLUSH (в параллельном режиме блок
+ * сжимается без словаря), так что с нее можно начать raw inflate
+ *
+ * На уровне 0 deflate не используется: данные сразу оформляются в stored
+ * блоки крупными порциями
+ */
+class OStream : public codec::OStream {
 public:
-	OStream(io::OStream &out, int level = 9);
+	OStream(io::OStream &out, int level = 9, int threads = 0);
 	~OStream();
-	virtual void Write(const char *buf, int size);
+	virtual void Write(const char *buf, int64_t size);
 	virtual int64_t Offset();
 
-	void Flush(bool finish);
-	void SetLevel(int level, int strategy = Z_DEFAULT_STRATEGY);
-	int64_t TotalOut() const;
+	virtual void Flush(bool finish);
+	virtual void SetLevel(int level);
+	void SetLevel(int level, int strategy);
+	virtual bool Checkpoint();
+	virtual bool SetDictionary(const string &dict);
+	virtual void Mark(const std::function<void()> &fn);
+	virtual void Sync();
+	virtual int64_t TotalOut() const;
 private:
+	class Parallel;
 	io::OStream &m_out;
 	z_stream m_strm;
 	int64_t m_offset;
 	int64_t m_total_out;
 	bool m_empty;
+	int m_level;
+	int m_strategy;
+	string m_dict;
+	std::shared_ptr<Parallel> m_parallel;
+	bool m_store;
+	bool m_started;
+	string m_stored;
+	string m_framed;
+	uLong m_crc;
+	int64_t m_size;
 
 	void Pack(const char *buf, int size, int flush);
+	void Start();
+	void Store(bool finish);
 };
 
 string Pack(const string &data);
+/// как закончить данные файла в member отдельным member (DataEnd, CopyData)
+struct DataTail {
+	/// длина начала member до последней границы блока перед концом данных
+	int64_t length;
+	/// сколько бит следующего байта еще относится к началу и их значение
+	int bits;
+	int last;
+	/// до 32К данных перед границей (словарь) и данные после нее
+	string window;
+	string rest;
+	/// контрольная сумма данных
+	uLong crc;
+};
+/**
+ * Разобрать member, начинающийся в текущей позиции in, до первых size
+ * распакованных байт. Целые блоки deflate перед концом данных копируются
+ * как есть, остаток сжимается заново. false, если member короче size.
+ * Из in может быть прочитано больше
+ */
+bool DataEnd(io::IStream &in, int64_t size, DataTail &tail);
+/// скопировать начало member (см. DataEnd) и закончить его как отдельный member
+void CopyData(io::IStream &in, io::OStream &out, const DataTail &tail, int64_t size);
+/// начало member, который заканчивается ровно в конце data, -1 если такого нет
+int LastMember(const string &data);
+/// footer фиксированного формата, пишется сразу после упакованного заголовка
+string Footer(int64_t listing_size, const string &packed_header);
+uLong Crc32(uLong crc, const char *buf, size_t size);
 std::map<string, string> GetHeader(slice::IStream &in);
 } // end of gzip namespace
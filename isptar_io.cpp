@@ -1,14 +1,109 @@
 #include "isptar_io.h"
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 #include <stdexcept>
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <mutex>
+#include <deque>
 
 namespace io {
+static size_t buffer_size = IO_BUFFER;
+
+void SetBufferSize(size_t size) { buffer_size = std::max(size, (size_t)CHUNK); }
+
+size_t BufferSize() { return buffer_size; }
+
+static bool drop_cache = false;
+static bool direct_write = false;
+
+void SetDropCache(bool drop) { drop_cache = drop; }
+
+bool DropCache() { return drop_cache; }
+
+void SetDirectWrite(bool direct) { direct_write = direct; }
+
+bool DirectWrite() { return direct_write; }
+
+/// дописывает к res, какие страницы [start, start + size) лежат в page cache
+static bool Resident(int fd, int64_t start, int64_t size, std::vector<unsigned char> &res) {
+	// окно не заходит за конец файла: мелкому файлу не нужен mmap на весь CACHE_WINDOW
+	struct stat st;
+	if (fstat(fd, &st))
+		return false;
+	size = std::min(size, (int64_t)st.st_size - start);
+	if (size <= 0)
+		return true;
+	void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, start);
+	if (addr == MAP_FAILED)
+		return false;
+	const size_t old = res.size();
+	res.resize(old + (size + DIRECT_ALIGN - 1) / DIRECT_ALIGN);
+	bool ok = mincore(addr, size, &res[old]) == 0;
+	munmap(addr, size);
+	return ok;
+}
+
+CacheDropper::CacheDropper() : m_start(0), m_known(false) {}
+
+void CacheDropper::Reset() {
+	m_resident.clear();
+	m_known = false;
+}
+
+void CacheDropper::Before(int fd, int64_t pos, int64_t size) {
+	if (!drop_cache || size <= 0)
+		return;
+	const int64_t first = pos / DIRECT_ALIGN * DIRECT_ALIGN;
+	const int64_t end = m_start + (int64_t)m_resident.size() * DIRECT_ALIGN;
+	if (m_known && first >= m_start + CACHE_WINDOW && first < end && pos + size <= end + CACHE_WINDOW) {
+		// чтение дошло до второго окна: первое уже не нужно, следующее
+		// снимается сейчас, пока до него не добрался readahead
+		m_resident.erase(m_resident.begin(), m_resident.begin() + CACHE_WINDOW / DIRECT_ALIGN);
+		m_start += CACHE_WINDOW;
+		m_known = Resident(fd, end, CACHE_WINDOW, m_resident);
+	} else if (!m_known || first < m_start || pos + size > end) {
+		m_start = first;
+		m_resident.clear();
+		m_known = Resident(fd, first, std::max<int64_t>(2 * CACHE_WINDOW, pos + size - first), m_resident);
+	}
+	if (!m_known)
+		m_resident.clear();
+}
+
+void CacheDropper::After(int fd, int64_t pos, int64_t size) {
+	if (!drop_cache || size <= 0)
+		return;
+	if (!m_known) {
+		posix_fadvise(fd, pos, size, POSIX_FADV_DONTNEED);
+		return;
+	}
+	// страницы кэша бывают больше DIRECT_ALIGN и не выкидываются, пока
+	// попадают в диапазон частично, поэтому сбрасывается и прочитанное ранее
+	const size_t first = (std::max(m_start, pos - CACHE_WINDOW / 4) - m_start) / DIRECT_ALIGN;
+	const size_t last = std::min(m_resident.size(), (size_t)((pos + size - m_start + DIRECT_ALIGN - 1) / DIRECT_ALIGN));
+	for (size_t i = first; i < last; ) {
+		if (m_resident[i] & 1) {
+			++i;
+			continue;
+		}
+		size_t end = i;
+		while (end < last && !(m_resident[end] & 1))
+			++end;
+		posix_fadvise(fd, m_start + i * DIRECT_ALIGN, (end - i) * DIRECT_ALIGN, POSIX_FADV_DONTNEED);
+		i = end;
+	}
+}
+
 void OStream::WriteStream(IStream &in) {
-	int size;
-	char buf[CHUNK];
-	while ((size = in.Read(buf, sizeof(buf))) > 0)
-		Write(buf, size);
+	std::vector<char> buf(BufferSize());
+	int64_t size;
+	while ((size = in.Read(&buf[0], buf.size())) > 0)
+		Write(&buf[0], size);
 }
 
 void OStream::WriteStr(const string &str) { Write(str.data(), str.size()); }
@@ -17,13 +112,21 @@ FileIStream::FileIStream() {}
 FileIStream::FileIStream(ResHandle fd) : m_fd(fd) {}
 FileIStream::FileIStream(const string &name)
 	: m_fd(open(name.c_str(), O_RDONLY|O_LARGEFILE)) { }
-void FileIStream::Reset(ResHandle fd) { m_fd = fd; }
+void FileIStream::Reset(ResHandle fd) {
+	m_fd = fd;
+	m_cache.Reset();
+}
 ResHandle FileIStream::fd() { return m_fd; }
 
-int FileIStream::Read(char *buf, int size) {
-	int res = read(m_fd, buf, size);
+int64_t FileIStream::Read(char *buf, int64_t size) {
+	int64_t pos = drop_cache ? lseek64(m_fd, 0, SEEK_CUR) : -1;
+	if (pos != -1)
+		m_cache.Before(m_fd, pos, size);
+	int64_t res = read(m_fd, buf, size);
 	if (res == -1)
 		throw std::runtime_error("Failed to read data from file");
+	if (pos != -1)
+		m_cache.After(m_fd, pos, res);
 	return res;
 }
 
@@ -34,21 +137,104 @@ int64_t FileIStream::Seek(int64_t pos, int whence) {
 	return res;
 }
 
-FileOStream::FileOStream() {}
-FileOStream::FileOStream(ResHandle fd) : m_fd(fd) {}
-FileOStream::FileOStream(const string &name) {
+string ExtentsStr(const Extents &extents) {
+	string res;
+	ForEachI(extents, extent)
+		res += (res.empty() ? "" : ",") + misc::Str(extent->first) + '+' + misc::Str(extent->second);
+	return res;
+}
+
+Extents ParseExtents(const string &str) {
+	Extents res;
+	string tmp = str;
+	while (!tmp.empty()) {
+		string extent = misc::GetWord(tmp, ',');
+		int64_t offset = misc::Int(misc::GetWord(extent, '+'));
+		int64_t length = misc::Int(extent);
+		if (length > 0)
+			res.push_back(std::make_pair(offset, length));
+	}
+	return res;
+}
+
+SparseIStream::SparseIStream(ResHandle fd, int64_t size)
+	: m_fd(fd)
+	, m_size(size)
+	, m_pos(0)
+	, m_extent(0) {
+	for (int64_t pos = 0; pos < size; ) {
+		int64_t data = lseek64(m_fd, pos, SEEK_DATA);
+		if (data == -1) {
+			// ENXIO: до конца файла дыра, иначе файловая система не умеет
+			if (errno != ENXIO)
+				m_extents.assign(1, std::make_pair(0, size));
+			break;
+		}
+		if (data >= size)
+			break;
+		int64_t hole = lseek64(m_fd, data, SEEK_HOLE);
+		if (hole == -1 || hole > size)
+			hole = size;
+		if (!m_extents.empty() && data - (m_extents.back().first + m_extents.back().second) < SPARSE_MIN_HOLE)
+			m_extents.back().second = hole - m_extents.back().first;
+		else
+			m_extents.push_back(std::make_pair(data, hole - data));
+		pos = hole;
+	}
+	if (m_extents.size() == 1 && m_extents[0].first == 0 && m_extents[0].second == size)
+		m_extents.clear();
+	else if (m_extents.empty())
+		m_extents.push_back(std::make_pair(size, 0));
+}
+
+const Extents & SparseIStream::extents() const { return m_extents; }
+
+int64_t SparseIStream::Read(char *buf, int64_t size) {
+	if (m_pos >= m_size)
+		return 0;
+	size = std::min(size, m_size - m_pos);
+	while (m_extent < m_extents.size() && m_pos >= m_extents[m_extent].first + m_extents[m_extent].second)
+		++m_extent;
+	if (m_extent < m_extents.size() && m_pos >= m_extents[m_extent].first) {
+		int64_t len = std::min(size, m_extents[m_extent].first + m_extents[m_extent].second - m_pos);
+		m_cache.Before(m_fd, m_pos, len);
+		int64_t res = pread64(m_fd, buf, len, m_pos);
+		if (res == -1)
+			throw std::runtime_error("Failed to read data from file");
+		m_cache.After(m_fd, m_pos, res);
+		m_pos += res;
+		return res;
+	}
+	int64_t end = m_extent < m_extents.size() ? m_extents[m_extent].first : m_size;
+	int64_t len = std::min(size, end - m_pos);
+	memset(buf, 0, len);
+	m_pos += len;
+	return len;
+}
+
+FileOStream::FileOStream() : m_written(0), m_dropped(0) {}
+FileOStream::FileOStream(ResHandle fd) : m_fd(fd), m_written(0), m_dropped(0) {}
+FileOStream::FileOStream(const string &name) : m_written(0), m_dropped(0) {
 	misc::Su su;
 	m_fd = open(name.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_LARGEFILE, 0666);
 	if (!m_fd)
 		throw std::runtime_error("Failed to create file " + name);
 }
 
-void FileOStream::Reset(ResHandle fd) { m_fd = fd; }
+void FileOStream::Reset(ResHandle fd) {
+	m_fd = fd;
+	m_written = m_dropped = 0;
+}
 ResHandle FileOStream::fd() { return m_fd; }
 
-void FileOStream::Write(const char *buf, int size) {
-	if (write(m_fd, buf, size) != size)
-		throw std::runtime_error("Failed to write data to stream");
+void FileOStream::Write(const char *buf, int64_t size) {
+	while (size > 0) {
+		int64_t res = write(m_fd, buf, size);
+		if (res <= 0)
+			throw std::runtime_error("Failed to write data to stream");
+		buf += res;
+		size -= res;
+	}
 }
 
 int64_t FileOStream::Offset() const {
@@ -57,5 +243,168 @@ int64_t FileOStream::Offset() const {
 		throw std::runtime_error("Failed to get file position");
 	return res;
 }
+
+void FileOStream::Drop(bool all) {
+	if (!drop_cache || !m_fd)
+		return;
+	int64_t pos = lseek64(m_fd, 0, SEEK_CUR);
+	if (pos == -1)
+		return;
+	if (pos > m_written)
+		sync_file_range(m_fd, m_written, pos - m_written, SYNC_FILE_RANGE_WRITE);
+	int64_t end = all ? pos : m_written;
+	if (end > m_dropped) {
+		// грязные страницы fadvise не выкидывает, сначала дожидаемся их записи
+		sync_file_range(m_fd, m_dropped, end - m_dropped,
+			SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(m_fd, m_dropped, end - m_dropped, POSIX_FADV_DONTNEED);
+		m_dropped = end;
+	}
+	m_written = pos;
+}
+
+/**
+ * Дописанные файлы (FileOStream::DropLater), запись которых уже запущена.
+ * Старые ждутся и убираются из кэша вне m_mutex, чтобы запись из других
+ * потоков не стояла
+ */
+class DropQueue {
+public:
+	DropQueue() : m_size(0) {}
+	~DropQueue() { Drop(0, 0); }
+
+	void Add(const ResHandle &fd, int64_t from, int64_t to) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			File file = { fd, from, to };
+			m_files.push_back(file);
+			m_size += to - from;
+		}
+		Drop(DROP_FILES, CACHE_WINDOW);
+	}
+
+private:
+	struct File {
+		ResHandle fd;
+		int64_t from;
+		int64_t to;
+	};
+	std::mutex m_mutex;
+	std::deque<File> m_files;
+	int64_t m_size;
+
+	void Drop(size_t files, int64_t size) {
+		std::vector<File> old;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			while (!m_files.empty() && (m_files.size() > files || m_size > size)) {
+				old.push_back(m_files.front());
+				m_size -= m_files.front().to - m_files.front().from;
+				m_files.pop_front();
+			}
+		}
+		ForEachI(old, file) {
+			sync_file_range(file->fd, file->from, file->to - file->from,
+				SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(file->fd, file->from, file->to - file->from, POSIX_FADV_DONTNEED);
+		}
+	}
+};
+
+static DropQueue drop_queue;
+
+void FileOStream::DropLater() {
+	if (!drop_cache || !m_fd)
+		return;
+	int64_t pos = lseek64(m_fd, 0, SEEK_CUR);
+	if (pos == -1)
+		return;
+	if (pos > m_written)
+		sync_file_range(m_fd, m_written, pos - m_written, SYNC_FILE_RANGE_WRITE);
+	m_written = pos;
+	if (pos > m_dropped) {
+		drop_queue.Add(m_fd, m_dropped, pos);
+		m_dropped = pos;
+	}
+}
+
+BufferedOStream::BufferedOStream(OStream &out, size_t size)
+	: m_out(out)
+	, m_buf(size)
+	, m_size(0) {}
+
+void BufferedOStream::Write(const char *buf, int64_t size) {
+	if (m_size + size > m_buf.size()) {
+		Flush();
+		if ((size_t)size >= m_buf.size()) {
+			m_out.Write(buf, size);
+			return;
+		}
+	}
+	memcpy(&m_buf[m_size], buf, size);
+	m_size += size;
+}
+
+void BufferedOStream::Flush() {
+	if (m_size)
+		m_out.Write(&m_buf[0], m_size);
+	m_size = 0;
+}
+
+DirectOStream::DirectOStream(const ResHandle &fd, size_t size)
+	: m_file(fd)
+	, m_buf(NULL)
+	, m_capacity((size + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN)
+	, m_size(0)
+	, m_direct(false) {
+	if (posix_memalign((void **)&m_buf, DIRECT_ALIGN, m_capacity))
+		throw std::runtime_error("Failed to allocate buffer");
+	SetDirect(true);
+}
+
+DirectOStream::~DirectOStream() { free(m_buf); }
+
+void DirectOStream::Reset(const ResHandle &fd) {
+	Flush();
+	m_file.Reset(fd);
+	SetDirect(true);
+}
+
+void DirectOStream::Write(const char *buf, int64_t size) {
+	while (size > 0) {
+		size_t len = std::min((size_t)size, m_capacity - m_size);
+		memcpy(m_buf + m_size, buf, len);
+		m_size += len;
+		buf += len;
+		size -= len;
+		if (m_size == m_capacity) {
+			m_file.Write(m_buf, m_size);
+			m_size = 0;
+			if (!m_direct)
+				m_file.Drop(false);
+		}
+	}
+}
+
+void DirectOStream::Flush() {
+	size_t aligned = m_size / DIRECT_ALIGN * DIRECT_ALIGN;
+	if (aligned)
+		m_file.Write(m_buf, aligned);
+	if (m_size > aligned) {
+		if (m_direct)
+			SetDirect(false);
+		m_file.Write(m_buf + aligned, m_size - aligned);
+	}
+	m_size = 0;
+	m_file.Drop(true);
+}
+
+void DirectOStream::SetDirect(bool direct) {
+	int flags = fcntl(m_file.fd(), F_GETFL);
+	m_direct = flags != -1 && direct &&
+		fcntl(m_file.fd(), F_SETFL, flags | O_DIRECT) == 0;
+	if (flags != -1 && !m_direct)
+		fcntl(m_file.fd(), F_SETFL, flags & ~O_DIRECT);
+}
 } // end of io namespace
 
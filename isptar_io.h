@@ -1,7 +1,13 @@
 #ifndef __ISPTAR_IO_H__
 #define __ISPTAR_IO_H__
 #include "isptar_misc.h"
+#include <vector>
 #define	CHUNK	4096
+#define	IO_BUFFER	(1024 * 1024)
+#define	SPARSE_MIN_HOLE	(64 * 1024)
+#define	DIRECT_ALIGN	4096
+#define	CACHE_WINDOW	(16 * 1024 * 1024)
+#define	DROP_FILES	64
 
 namespace io {
 using namespace misc;
@@ -9,18 +15,51 @@ using namespace misc;
 class IStream {
 public:
 	virtual ~IStream() {}
-	virtual int Read(char *buf, int size) = 0;
+	virtual int64_t Read(char *buf, int64_t size) = 0;
 };
 
 class OStream {
 public:
 	virtual ~OStream() {}
-	virtual void Write(const char *buf, int size) = 0;
+	virtual void Write(const char *buf, int64_t size) = 0;
 
 	void WriteStream(IStream &in);
 	void WriteStr(const std::string &str);
 };
 
+/// размер буферов для чтения и записи данных файлов, по умолчанию IO_BUFFER
+void SetBufferSize(size_t size);
+size_t BufferSize();
+/**
+ * Не вытеснять чужие данные из page cache: прочитанные FileIStream и
+ * SparseIStream страницы, которых не было в кэше до чтения, сразу
+ * сбрасываются, записанное сбрасывается через FileOStream::Drop
+ */
+void SetDropCache(bool drop);
+bool DropCache();
+/// писать slice через DirectOStream
+void SetDirectWrite(bool direct);
+bool DirectWrite();
+
+/**
+ * Сброс из page cache прочитанных страниц при DropCache. Какие страницы
+ * были в кэше до чтения, запоминается окнами по CACHE_WINDOW на окно вперед,
+ * иначе readahead самого чтения принимался бы за чужой кэш
+ */
+class CacheDropper {
+public:
+	CacheDropper();
+	void Reset();
+	/// перед чтением [pos, pos + size)
+	void Before(int fd, int64_t pos, int64_t size);
+	/// после чтения [pos, pos + size)
+	void After(int fd, int64_t pos, int64_t size);
+private:
+	int64_t m_start;
+	std::vector<unsigned char> m_resident;
+	bool m_known;
+};
+
 class FileIStream : public IStream {
 public:
 	FileIStream();
@@ -29,10 +68,38 @@ public:
 	void Reset(ResHandle fd);
 	ResHandle fd();
 
-	virtual int Read(char *buf, int size);
+	virtual int64_t Read(char *buf, int64_t size);
 	virtual int64_t Seek(int64_t pos, int whence);
 private:
 	ResHandle m_fd;
+	CacheDropper m_cache;
+};
+
+/// участки данных разреженного файла: смещение и длина
+typedef std::vector<std::pair<int64_t, int64_t> > Extents;
+/// "смещение+длина,...", у файла без данных единственный участок нулевой длины в конце
+string ExtentsStr(const Extents &extents);
+Extents ParseExtents(const string &str);
+
+/**
+ * Чтение разреженного файла: участки данных находятся через SEEK_DATA/SEEK_HOLE,
+ * дыры отдаются нулями без обращения к диску. Дыры короче SPARSE_MIN_HOLE
+ * считаются данными
+ */
+class SparseIStream : public IStream {
+public:
+	SparseIStream(ResHandle fd, int64_t size);
+	/// пусто, если дыр в файле нет
+	const Extents & extents() const;
+
+	virtual int64_t Read(char *buf, int64_t size);
+private:
+	ResHandle m_fd;
+	int64_t m_size;
+	int64_t m_pos;
+	Extents m_extents;
+	size_t m_extent;
+	CacheDropper m_cache;
 };
 
 class FileOStream : public OStream {
@@ -43,10 +110,64 @@ public:
 	void Reset(ResHandle fd);
 	ResHandle fd();
 
-	virtual void Write(const char *buf, int size);
+	virtual void Write(const char *buf, int64_t size);
 	virtual int64_t Offset() const;
+	/**
+	 * При DropCache: запустить запись на диск всего записанного после
+	 * прошлого вызова, а то, что было записано до него (all - все),
+	 * дождаться и убрать из page cache
+	 */
+	void Drop(bool all);
+	/**
+	 * Файл дописан: запустить запись оставшегося, а дождаться ее и убрать
+	 * файл из кэша позже, когда за ним будет записано еще CACHE_WINDOW или
+	 * DROP_FILES файлов (иначе каждый мелкий файл ждет диска)
+	 */
+	void DropLater();
 private:
 	ResHandle m_fd;
+	int64_t m_written;
+	int64_t m_dropped;
+};
+
+/**
+ * Запись в обход page cache (O_DIRECT). Данные копируются в выровненный
+ * буфер и пишутся блоками, кратными DIRECT_ALIGN. Хвост короче блока
+ * дописывается в Flush уже без O_DIRECT, поэтому Flush вызывается только
+ * в конце файла. Если файловая система не умеет O_DIRECT, данные пишутся
+ * обычным образом и сбрасываются из кэша
+ */
+class DirectOStream : public OStream {
+public:
+	DirectOStream(const ResHandle &fd, size_t size = BufferSize());
+	~DirectOStream();
+	/// продолжить запись в начало другого файла
+	void Reset(const ResHandle &fd);
+	virtual void Write(const char *buf, int64_t size);
+	void Flush();
+private:
+	FileOStream m_file;
+	char *m_buf;
+	size_t m_capacity;
+	size_t m_size;
+	bool m_direct;
+
+	void SetDirect(bool direct);
+};
+
+/**
+ * Копит мелкие записи и передает их в out порциями размера буфера, крупные
+ * записи идут в out напрямую. Буфер выталкивается только через Flush
+ */
+class BufferedOStream : public OStream {
+public:
+	BufferedOStream(OStream &out, size_t size = BufferSize());
+	virtual void Write(const char *buf, int64_t size);
+	void Flush();
+private:
+	OStream &m_out;
+	std::vector<char> m_buf;
+	size_t m_size;
 };
 } // end of misc namespace
 
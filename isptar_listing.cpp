@@ -0,0 +1,312 @@
+#include "isptar_listing.h"
+#include <string.h>
+#include <stdexcept>
+#include <algorithm>
+#define	LISTING_BUFFER	(64 * 1024)
+/// в двоичном листинге: конец листинга и начало блока вместо кода типа записи
+#define	RECORD_END		0
+#define	RECORD_RESTART	0xff
+#define	HAS_POSITION	1
+#define	HAS_ATTRS		2
+
+namespace listing {
+static const int types[] = { REGTYPE, DIRTYPE, SYMTYPE, LNKTYPE, CHRTYPE, BLKTYPE, FIFOTYPE, AREGTYPE };
+
+static int TypeCode(int type) {
+	for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i)
+		if (types[i] == type)
+			return i + 1;
+	return sizeof(types) / sizeof(types[0]);
+}
+
+/// "глубина:slice:смещение:смещение в member", если числа записаны без лишних символов
+static bool ParsePosition(const string &pos, uint64_t *nums) {
+	string tmp = pos;
+	for (int i = 0; i < 4; ++i) {
+		if (tmp.empty())
+			return false;
+		string word = misc::GetWord(tmp, ':');
+		if (word.empty() || word.find_first_not_of("0123456789") != string::npos || misc::Str(misc::Int(word)) != word)
+			return false;
+		nums[i] = misc::Int(word);
+	}
+	return tmp.empty() && pos[pos.size() - 1] != ':';
+}
+
+Writer::Writer(io::OStream &out, int version) : m_out(out), m_version(version) {}
+
+void Writer::Write(const string &line) {
+	if (m_version == LISTING_TEXT) {
+		m_out.WriteStr(line + '\n');
+		return;
+	}
+	tar::FileInfo info;
+	string tail = line;
+	info.Set(tail);
+	m_rec.clear();
+	m_rec.push_back(TypeCode(info.type));
+	size_t common = 0;
+	while (common < m_name.size() && common < info.filename.size() && m_name[common] == info.filename[common])
+		++common;
+	Varint(common);
+	Bytes(info.filename.substr(common));
+	m_name = info.filename;
+	Owner(m_users, info.user, info.uid);
+	Owner(m_groups, info.group, info.gid);
+	Varint((uint32_t)info.mode);
+	switch (info.type) {
+		case REGTYPE:
+			// zigzag: время может быть отрицательным
+			Varint(((uint64_t)info.time << 1) ^ (uint64_t)((int64_t)info.time >> 63));
+			Varint(info.size);
+			break;
+		case LNKTYPE:
+		case SYMTYPE:
+			Bytes(info.linkname);
+			break;
+		case CHRTYPE:
+		case BLKTYPE:
+			Varint((uint32_t)info.devmajor);
+			Varint((uint32_t)info.devminor);
+			break;
+	}
+	string attrs = tail;
+	string pos = misc::GetWord(attrs, '\t');
+	uint64_t nums[4];
+	if ((!attrs.empty() || pos == tail) && ParsePosition(pos, nums)) {
+		m_rec.push_back(HAS_POSITION | (attrs.empty() ? 0 : HAS_ATTRS));
+		for (int i = 0; i < 4; ++i)
+			Varint(nums[i]);
+		if (!attrs.empty())
+			Bytes(attrs);
+	} else {
+		m_rec.push_back(tail.empty() ? 0 : HAS_ATTRS);
+		if (!tail.empty())
+			Bytes(tail);
+	}
+	m_out.WriteStr(m_rec);
+}
+
+void Writer::Restart() {
+	if (m_version == LISTING_TEXT)
+		return;
+	m_name.clear();
+	m_users.clear();
+	m_groups.clear();
+	const char mark = (char)RECORD_RESTART;
+	m_out.Write(&mark, 1);
+}
+
+void Writer::Finish() {
+	if (m_version == LISTING_TEXT) {
+		m_out.WriteStr("\n");
+		return;
+	}
+	const char mark = RECORD_END;
+	m_out.Write(&mark, 1);
+}
+
+void Writer::Owner(std::map<string, int> &table, const string &name, int id) {
+	const string key = misc::Str(id) + '#' + name;
+	auto entry = table.find(key);
+	if (entry != table.end()) {
+		Varint(entry->second);
+		return;
+	}
+	int index = table.size();
+	table[key] = index;
+	Varint(index);
+	Varint((uint32_t)id);
+	Bytes(name);
+}
+
+void Writer::Varint(uint64_t val) {
+	while (val >= 0x80) {
+		m_rec.push_back((char)(val | 0x80));
+		val >>= 7;
+	}
+	m_rec.push_back((char)val);
+}
+
+void Writer::Bytes(const string &val) {
+	Varint(val.size());
+	m_rec += val;
+}
+
+Reader::Reader(io::IStream &in, int version)
+	: m_in(in)
+	, m_version(version)
+	, m_buf(LISTING_BUFFER)
+	, m_pos(0)
+	, m_end(0) {}
+
+bool Reader::Read(tar::FileInfo &info, string &offs) {
+	return m_version == LISTING_TEXT ? ReadText(info, offs) : ReadBinary(info, offs);
+}
+
+void Reader::Restart() {
+	m_pos = m_end = 0;
+	m_name.clear();
+	m_users.clear();
+	m_groups.clear();
+}
+
+/**
+ * Строка разбирается прямо в буфере. Буфер сдвигается к началу только когда
+ * в остатке нет конца строки, и растет, если строка в него не помещается
+ */
+bool Reader::ReadText(tar::FileInfo &info, string &offs) {
+	const char *eol;
+	while (!(eol = (const char *)memchr(m_buf.data() + m_pos, '\n', m_end - m_pos))) {
+		if (m_pos > 0) {
+			memmove(m_buf.data(), m_buf.data() + m_pos, m_end - m_pos);
+			m_end -= m_pos;
+			m_pos = 0;
+		}
+		if (m_end == m_buf.size())
+			m_buf.resize(m_buf.size() * 2);
+		int size = m_in.Read(m_buf.data() + m_end, m_buf.size() - m_end);
+		if (size <= 0)
+			return false;
+		m_end += size;
+	}
+	const char *line = m_buf.data() + m_pos;
+	if (eol == line)
+		return false;
+	const char *tail = info.Set(line, eol);
+	offs.assign(tail, eol - tail);
+	m_pos = eol - m_buf.data() + 1;
+	return true;
+}
+
+bool Reader::ReadBinary(tar::FileInfo &info, string &offs) {
+	int type = Byte();
+	while (type == RECORD_RESTART) {
+		m_name.clear();
+		m_users.clear();
+		m_groups.clear();
+		type = Byte();
+	}
+	if (type == -1 || type == RECORD_END)
+		return false;
+	if (type > (int)(sizeof(types) / sizeof(types[0])))
+		throw std::runtime_error("Bad listing record");
+	uint64_t common = Varint();
+	if (common > m_name.size())
+		throw std::runtime_error("Bad listing record");
+	m_name.resize(common);
+	Bytes(m_name);
+	info.filename = m_name;
+	info.type = types[type - 1];
+	Owner(m_users, info.user, info.uid);
+	Owner(m_groups, info.group, info.gid);
+	info.mode = (uint32_t)Varint();
+	info.size = 0;
+	info.linkname.clear();
+	info.devmajor = 0;
+	info.devminor = 0;
+	info.time = 0;
+	switch (info.type) {
+		case REGTYPE: {
+			uint64_t time = Varint();
+			info.time = (int64_t)(time >> 1) ^ -(int64_t)(time & 1);
+			info.size = Varint();
+			break;
+		}
+		case LNKTYPE:
+		case SYMTYPE:
+			Bytes(info.linkname);
+			break;
+		case CHRTYPE:
+		case BLKTYPE:
+			info.devmajor = (uint32_t)Varint();
+			info.devminor = (uint32_t)Varint();
+			break;
+	}
+	int flags = Byte();
+	if (flags == -1)
+		throw std::runtime_error("Unexpected end of listing");
+	offs.clear();
+	if (flags & HAS_POSITION) {
+		for (int i = 0; i < 4; ++i) {
+			if (i)
+				offs.push_back(':');
+			offs += misc::Str(Varint());
+		}
+		if (flags & HAS_ATTRS)
+			offs.push_back('\t');
+	}
+	if (flags & HAS_ATTRS)
+		Bytes(offs);
+	return true;
+}
+
+int Reader::Byte() {
+	if (m_pos == m_end) {
+		int res = m_in.Read(&m_buf[0], m_buf.size());
+		if (res <= 0)
+			return -1;
+		m_pos = 0;
+		m_end = res;
+	}
+	return (unsigned char)m_buf[m_pos++];
+}
+
+uint64_t Reader::Varint() {
+	uint64_t res = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int byte = Byte();
+		if (byte == -1)
+			throw std::runtime_error("Unexpected end of listing");
+		res |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return res;
+	}
+	throw std::runtime_error("Bad listing record");
+}
+
+/// дописывает к val строку с длиной
+void Reader::Bytes(string &val) {
+	for (uint64_t left = Varint(); left > 0; ) {
+		if (m_pos == m_end) {
+			int res = m_in.Read(&m_buf[0], m_buf.size());
+			if (res <= 0)
+				throw std::runtime_error("Unexpected end of listing");
+			m_pos = 0;
+			m_end = res;
+		}
+		size_t len = std::min((uint64_t)(m_end - m_pos), left);
+		val.append(&m_buf[m_pos], len);
+		m_pos += len;
+		left -= len;
+	}
+}
+
+void Reader::Owner(std::vector<std::pair<string, int> > &table, string &name, int &id) {
+	uint64_t index = Varint();
+	if (index == table.size()) {
+		id = (uint32_t)Varint();
+		name.clear();
+		Bytes(name);
+		table.push_back(std::make_pair(name, id));
+	} else if (index < table.size()) {
+		name = table[index].first;
+		id = table[index].second;
+	} else
+		throw std::runtime_error("Bad listing record");
+}
+
+string Line(const tar::FileInfo &info, const string &offs) {
+	return offs.empty() ? info.Str() : info.Str() + '\t' + offs;
+}
+
+int Version(const std::map<string, string> &head) {
+	auto format = head.find("listing_format");
+	if (format == head.end())
+		return LISTING_TEXT;
+	int version = misc::Int(format->second);
+	if (version != LISTING_TEXT && version != LISTING_BINARY)
+		throw std::runtime_error("Unsupported listing format " + format->second);
+	return version;
+}
+} // end of listing namespace
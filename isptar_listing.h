@@ -0,0 +1,76 @@
+#ifndef __ISPTAR_LISTING_H__
+#define __ISPTAR_LISTING_H__
+#include "isptar_io.h"
+#include "isptar_tar.h"
+#include <map>
+#include <vector>
+#define	LISTING_TEXT	1
+#define	LISTING_BINARY	2
+
+/**
+ * Листинг архива. Версия 1 - текстовые строки FileInfo::Str(), за которыми
+ * через табуляцию идут позиция данных и атрибуты. Версия 2 - двоичные записи:
+ * имя хранится длиной общего с предыдущим именем начала и остатком, числа -
+ * varint, пользователи и группы - номерами в таблицах, которые пополняются
+ * по ходу листинга. Позиция и атрибуты (TarReader::Offset) в обеих версиях
+ * отдаются одной строкой. В начале каждого блока индекса листинга состояние
+ * сбрасывается, чтобы читать можно было с контрольной точки
+ */
+namespace listing {
+using std::string;
+
+class Writer {
+public:
+	Writer(io::OStream &out, int version);
+	/// line в формате версии 1
+	void Write(const string &line);
+	/// следующая запись начинает новый блок
+	void Restart();
+	void Finish();
+
+private:
+	io::OStream &m_out;
+	const int m_version;
+	string m_name;
+	std::map<string, int> m_users;
+	std::map<string, int> m_groups;
+	string m_rec;
+
+	void Owner(std::map<string, int> &table, const string &name, int id);
+	void Varint(uint64_t val);
+	void Bytes(const string &val);
+};
+
+class Reader {
+public:
+	Reader(io::IStream &in, int version);
+	/// false в конце листинга, info при этом не меняется
+	bool Read(tar::FileInfo &info, string &offs);
+	/// вызвать после перехода потока к началу блока
+	void Restart();
+
+private:
+	io::IStream &m_in;
+	const int m_version;
+	std::vector<char> m_buf;
+	size_t m_pos;
+	size_t m_end;
+	string m_name;
+	std::vector<std::pair<string, int> > m_users;
+	std::vector<std::pair<string, int> > m_groups;
+
+	bool ReadText(tar::FileInfo &info, string &offs);
+	bool ReadBinary(tar::FileInfo &info, string &offs);
+	int Byte();
+	uint64_t Varint();
+	void Bytes(string &val);
+	void Owner(std::vector<std::pair<string, int> > &table, string &name, int &id);
+};
+
+/// строка листинга версии 1
+string Line(const tar::FileInfo &info, const string &offs);
+/// версия листинга по заголовку архива
+int Version(const std::map<string, string> &head);
+} // end of listing namespace
+
+#endif
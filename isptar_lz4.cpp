@@ -0,0 +1,122 @@
+#include "isptar_lz4.h"
+#include <string.h>
+#include <stdexcept>
+#define	LZ4_STEP	(64 * 1024)
+
+namespace lz4 {
+static size_t Check(size_t res, const char *what) {
+	if (LZ4F_isError(res))
+		throw std::runtime_error(std::string(what) + ": " + LZ4F_getErrorName(res));
+	return res;
+}
+
+IStream::IStream(io::IStream &in, int64_t limit)
+	: m_in(in)
+	, m_limit(limit)
+	, m_pos(0)
+	, m_size(0)
+	, m_end(false) {
+	Check(LZ4F_createDecompressionContext(&m_ctx, LZ4F_VERSION), "Failed to init lz4");
+}
+
+IStream::~IStream() { LZ4F_freeDecompressionContext(m_ctx); }
+
+void IStream::Reset(int64_t limit) {
+	m_limit = limit;
+	m_pos = 0;
+	m_size = 0;
+	m_end = false;
+	LZ4F_resetDecompressionContext(m_ctx);
+}
+
+int64_t IStream::Read(char *buf, int64_t size) {
+	size_t done = 0;
+	while (!m_end && done < (size_t)size) {
+		size_t dst = size - done;
+		size_t src = m_size - m_pos;
+		size_t res = Check(LZ4F_decompress(m_ctx, buf + done, &dst, m_buf + m_pos, &src, NULL),
+			"Failed to extract");
+		m_pos += src;
+		done += dst;
+		m_end = res == 0;
+		if (!dst && !src) {
+			// распаковщику нужны новые данные
+			int len = m_limit == -1 || m_limit > (int64_t)sizeof(m_buf)
+				? sizeof(m_buf)
+				: m_limit;
+			int64_t have = m_in.Read(m_buf, len);
+			if (have == -1)
+				throw std::runtime_error("Failed to get input");
+			if (have == 0)
+				break;
+			if (m_limit != -1)
+				m_limit -= have;
+			m_pos = 0;
+			m_size = have;
+		}
+	}
+	return done;
+}
+
+OStream::OStream(io::OStream &out, int level)
+	: m_out(out)
+	, m_offset(0)
+	, m_total_out(0)
+	, m_started(false)
+	, m_empty(true) {
+	Check(LZ4F_createCompressionContext(&m_ctx, LZ4F_VERSION), "Failed to init lz4");
+	memset(&m_prefs, 0, sizeof(m_prefs));
+	m_prefs.compressionLevel = level;
+	m_buf.resize(LZ4F_compressBound(LZ4_STEP, &m_prefs));
+}
+
+OStream::~OStream() { LZ4F_freeCompressionContext(m_ctx); }
+
+void OStream::Write(const char *buf, int64_t size) {
+	if (size <= 0)
+		return;
+	m_total_out += size;
+	if (!m_started) {
+		Put(Check(LZ4F_compressBegin(m_ctx, &m_buf[0], m_buf.size(), &m_prefs), "Failed to compress"));
+		m_started = true;
+	}
+	while (size > 0) {
+		int64_t len = std::min(size, (int64_t)LZ4_STEP);
+		Put(Check(LZ4F_compressUpdate(m_ctx, &m_buf[0], m_buf.size(), buf, len, NULL), "Failed to compress"));
+		m_empty = false;
+		buf += len;
+		size -= len;
+	}
+}
+
+int64_t OStream::Offset() {
+	Flush(false);
+	return m_offset;
+}
+
+void OStream::Flush(bool finish) {
+	if (!m_started)
+		return;
+	if (finish) {
+		Put(Check(LZ4F_compressEnd(m_ctx, &m_buf[0], m_buf.size(), NULL), "Failed to compress"));
+		m_started = false;
+		m_offset = 0;
+	} else if (!m_empty) {
+		Put(Check(LZ4F_flush(m_ctx, &m_buf[0], m_buf.size(), NULL), "Failed to compress"));
+	}
+	m_empty = true;
+}
+
+void OStream::SetLevel(int level) {
+	Flush(true);
+	m_prefs.compressionLevel = level;
+}
+
+int64_t OStream::TotalOut() const { return m_total_out; }
+
+void OStream::Put(size_t size) {
+	if (size)
+		m_out.Write(&m_buf[0], size);
+	m_offset += size;
+}
+} // end of lz4 namespace
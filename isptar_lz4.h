@@ -0,0 +1,49 @@
+#ifndef __ISPTAR_LZ4_H__
+#define __ISPTAR_LZ4_H__
+#include <lz4frame.h>
+#include "isptar_codec.h"
+#include <vector>
+
+namespace lz4 {
+class IStream : public codec::IStream {
+public:
+	IStream(io::IStream &in, int64_t limit = -1);
+	~IStream();
+	virtual void Reset(int64_t limit = -1);
+
+	virtual int64_t Read(char *buf, int64_t size);
+private:
+	io::IStream &m_in;
+	int64_t m_limit;
+	LZ4F_dctx *m_ctx;
+	size_t m_pos;
+	size_t m_size;
+	bool m_end;
+	char m_buf[CHUNK];
+};
+
+class OStream : public codec::OStream {
+public:
+	OStream(io::OStream &out, int level);
+	~OStream();
+	virtual void Write(const char *buf, int64_t size);
+	virtual int64_t Offset();
+
+	virtual void Flush(bool finish);
+	virtual void SetLevel(int level);
+	virtual int64_t TotalOut() const;
+private:
+	io::OStream &m_out;
+	LZ4F_cctx *m_ctx;
+	LZ4F_preferences_t m_prefs;
+	std::vector<char> m_buf;
+	int64_t m_offset;
+	int64_t m_total_out;
+	bool m_started;
+	bool m_empty;
+
+	void Put(size_t size);
+};
+} // end of lz4 namespace
+
+#endif
@@ -2,6 +2,7 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdexcept>
 
 namespace misc {
@@ -27,7 +28,7 @@ void Su::Release() {
 
 Script::Script(const string &command) : m_command(command) {}
 void Script::AddParam(char ch, const string &value) { m_replace[ch] = value; }
-bool Script::Do() {
+string Script::Command() const {
 	string cmd = m_command;
 	for (auto pos = cmd.find('%'); pos != string::npos; pos = cmd.find('%', pos)) {
 		auto ptr = m_replace.find(cmd[pos + 1]);
@@ -35,7 +36,26 @@ bool Script::Do() {
 		cmd.replace(pos, 2, value);
 		pos += value.size();
 	}
+	return cmd;
+}
 
+static void Exec(const string &cmd, int out) {
+	if (dup2(open("/dev/null", O_WRONLY), 0) == -1)
+		_exit(1);
+	if (dup2(out, 1) == -1)
+		_exit(1);
+	if (dup2(out, 2) == -1)
+		_exit(1);
+	for (int i = getdtablesize(); i > 2; --i)
+		close(i);
+	setegid(getgid());
+	seteuid(getuid());
+	execl("/bin/sh", "/bin/sh", "-c", cmd.c_str(), (char *)0);
+	_exit(1);
+}
+
+bool Script::Do() {
+	const string cmd = Command();
 	int pfd[2];
 	if (pipe(pfd))
 		throw std::runtime_error("Failed to open pipe");
@@ -45,32 +65,46 @@ bool Script::Do() {
 		close(pfd[1]);
 		throw std::runtime_error("Failed to fork");
 	}
-	if (pid == 0) {
-		if (dup2(open("/dev/null", O_WRONLY), 0) == -1)
-			_exit(1);
-		if (dup2(pfd[1], 1) == -1)
-			_exit(1);
-		if (dup2(pfd[1], 2) == -1)
-			_exit(1);
-		for (int i = getdtablesize(); i > 2; --i)
-			close(i);
-		setegid(getgid());
-		seteuid(getuid());
-		execl("/bin/sh", "/bin/sh", "-c", cmd.c_str(), (char *)0);
-		_exit(1);
-	}
+	if (pid == 0)
+		Exec(cmd, pfd[1]);
 	close(pfd[1]);
 	int size;
 	char buf[1024];
 	while ((size = read(pfd[0], buf, sizeof(buf))) > 0)
 		write(2, buf, size);
 	close(pfd[0]);
+	return Wait(pid);
+}
+
+pid_t Script::Start() {
+	const string cmd = Command();
+	auto pid = fork();
+	if (pid == -1)
+		throw std::runtime_error("Failed to fork");
+	if (pid == 0)
+		Exec(cmd, 2); // вывод сразу в stderr, stdout может быть занят данными
+	return pid;
+}
+
+static bool WaitStatus(pid_t pid, int &status) {
+	pid_t res;
+	while ((res = waitpid(pid, &status, 0)) == -1 && errno == EINTR)
+		;
+	return res == pid;
+}
+
+bool Script::Wait(pid_t pid) {
 	int status;
-	if (waitpid(pid, &status, 0) != pid)
+	if (!WaitStatus(pid, status))
 		throw std::runtime_error("Waitpid failed");
 	return (WIFEXITED(status) && WEXITSTATUS(status) == 0);
 }
 
+bool Script::TryWait(pid_t pid) {
+	int status;
+	return WaitStatus(pid, status) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
 static void Close(int *fd) {
 	close(*fd);
 	delete fd;
@@ -3,6 +3,7 @@
 #include <string>
 #include <memory>
 #include <map>
+#include <sys/types.h>
 #define	ForEachI(L, item) for (auto item = (L).begin(); item != (L).end(); ++item)
 
 namespace misc {
@@ -22,9 +23,16 @@ public:
 	Script(const string &command);
 	void AddParam(char, const string &value);
 	bool Do();
+	/// запустить в фоне, результат получить через Wait
+	pid_t Start();
+	static bool Wait(pid_t pid);
+	/// то же без исключений, для деструкторов
+	static bool TryWait(pid_t pid);
 private:
 	const string m_command;
 	std::map<char, string> m_replace;
+
+	string Command() const;
 };
 
 string GetWord(string &str, char ch);
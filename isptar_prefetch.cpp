@@ -0,0 +1,226 @@
+#include "isptar_prefetch.h"
+#include "isptar_io.h"
+#include "isptar_uring.h"
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <string.h>
+#include <stdexcept>
+#include <algorithm>
+
+namespace prefetch {
+enum State { QUEUED, LOADING, DONE };
+
+struct Scheduler::File {
+	misc::ResHandle fd;
+	int64_t size;
+	uint64_t key;
+	State state;
+	string data;
+	std::exception_ptr error;
+	/// для io_uring: сколько прочитано и куда читать дальше
+	int64_t done;
+	struct iovec iov;
+	io::CacheDropper cache;
+};
+
+/// физический адрес начала файла, если файловая система его сообщает
+static uint64_t Position(int fd, ino_t ino) {
+	uint64_t buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(uint64_t) + 1];
+	memset(buf, 0, sizeof(buf));
+	struct fiemap *map = (struct fiemap *)buf;
+	map->fm_length = FIEMAP_MAX_OFFSET;
+	map->fm_extent_count = 1;
+	if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0 &&
+			!(map->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN|FIEMAP_EXTENT_DATA_INLINE)))
+		return map->fm_extents[0].fe_physical;
+	return ino;
+}
+
+Scheduler::Scheduler()
+	: m_queued(0)
+	, m_last(0)
+	, m_stop(false)
+	, m_thread(&Scheduler::Run, this) {}
+
+Scheduler::~Scheduler() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_cond.notify_all();
+	m_thread.join();
+}
+
+void Scheduler::Add(const misc::ResHandle &fd, int64_t size, ino_t ino) {
+	FilePtr file(new File);
+	file->fd = fd;
+	file->size = size;
+	file->key = Position(fd, ino);
+	file->state = QUEUED;
+	file->done = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_files.push_back(file);
+		++m_queued;
+	}
+	m_cond.notify_all();
+}
+
+string Scheduler::Take() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_files.empty())
+		throw std::runtime_error("No prefetched file");
+	FilePtr file = m_files.front();
+	m_files.pop_front();
+	while (file->state != DONE) {
+		if (file->state == LOADING) {
+			m_cond.wait(lock);
+			continue;
+		}
+		file->state = LOADING;
+		--m_queued;
+		lock.unlock();
+		Load(*file);
+		lock.lock();
+		file->state = DONE;
+	}
+	if (file->error)
+		std::rethrow_exception(file->error);
+	return std::move(file->data);
+}
+
+void Scheduler::Run() {
+	// буферы брошенных заявок io_uring: ядро еще может в них писать
+	std::vector<string> abandoned;
+	std::unique_ptr<uring::Ring> ring;
+	try {
+		ring.reset(new uring::Ring(PREFETCH_DEPTH));
+	} catch (const std::exception &) {
+		// нет io_uring: читаем обычным read
+	}
+	std::vector<FilePtr> slots(PREFETCH_DEPTH);
+	size_t active = 0;
+	// поставить в ring чтение остатка файла
+	auto read = [&ring](File &file, uint64_t slot) {
+		file.iov.iov_base = &file.data[file.done];
+		file.iov.iov_len = file.size - file.done;
+		if (!ring->Read(file.fd, &file.iov, file.done, slot))
+			throw std::runtime_error("io_uring queue is full");
+	};
+	while (true) {
+		std::vector<FilePtr> start;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (!active)
+				m_cond.wait(lock, [this] { return m_stop || m_queued > 0; });
+			if (m_stop && !active)
+				return;
+			const size_t depth = ring ? PREFETCH_DEPTH : 1;
+			while (!m_stop && m_queued > 0 && active + start.size() < depth)
+				start.push_back(Next());
+		}
+		if (!ring) {
+			Load(*start.front());
+			Done(start.front());
+			continue;
+		}
+		try {
+			ForEachI(start, file) {
+				size_t slot = std::find(slots.begin(), slots.end(), FilePtr()) - slots.begin();
+				slots[slot] = *file;
+				++active;
+				// буфер в куче, а не внутри string: при отказе ring его можно бросить
+				(*file)->data.reserve(std::max((*file)->size, (int64_t)sizeof(string)));
+				(*file)->data.resize((*file)->size);
+				(*file)->cache.Before((*file)->fd, 0, (*file)->size);
+				read(**file, slot);
+			}
+			ring->Submit(1);
+			uint64_t slot;
+			int res;
+			while (ring->Complete(slot, res)) {
+				FilePtr file = slots[slot];
+				if (res > 0) {
+					file->done += res;
+					if (file->done < file->size) {
+						read(*file, slot);
+						continue;
+					}
+				} else if (res < 0)
+					file->error = std::make_exception_ptr(std::runtime_error("Failed to read data from file"));
+				file->data.resize(file->done);
+				file->cache.After(file->fd, 0, file->done);
+				slots[slot].reset();
+				--active;
+				Done(file);
+			}
+		} catch (...) {
+			// io_uring отказал: его заявки и остальное читает Load в новые буферы
+			ring.reset();
+			ForEachI(slots, slot) {
+				if (!*slot)
+					continue;
+				abandoned.push_back(std::move((*slot)->data));
+				(*slot)->data = string();
+				(*slot)->done = 0;
+				Load(**slot);
+				(*slot)->cache.After((*slot)->fd, 0, (*slot)->data.size());
+				Done(*slot);
+				slot->reset();
+			}
+			active = 0;
+			ForEachI(start, file) {
+				if ((*file)->state == DONE)
+					continue;
+				Load(**file);
+				Done(*file);
+			}
+		}
+	}
+}
+
+/// под m_mutex: ближайший файл дальше по диску, а если таких нет - с начала
+Scheduler::FilePtr Scheduler::Next() {
+	FilePtr file, first;
+	ForEachI(m_files, entry) {
+		if ((*entry)->state != QUEUED)
+			continue;
+		if ((*entry)->key >= m_last && (!file || (*entry)->key < file->key))
+			file = *entry;
+		if (!first || (*entry)->key < first->key)
+			first = *entry;
+	}
+	if (!file)
+		file = first;
+	file->state = LOADING;
+	--m_queued;
+	m_last = file->key;
+	return file;
+}
+
+void Scheduler::Done(const FilePtr &file) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		file->state = DONE;
+	}
+	m_cond.notify_all();
+}
+
+void Scheduler::Load(File &file) {
+	try {
+		io::FileIStream in(file.fd);
+		file.data.resize(file.size);
+		int64_t done = 0;
+		while (done < file.size) {
+			int64_t size = in.Read(&file.data[done], file.size - done);
+			if (size <= 0)
+				break;
+			done += size;
+		}
+		file.data.resize(done);
+	} catch (...) {
+		file.error = std::current_exception();
+	}
+}
+} // end of prefetch namespace
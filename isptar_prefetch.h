@@ -0,0 +1,57 @@
+#ifndef __ISPTAR_PREFETCH_H__
+#define __ISPTAR_PREFETCH_H__
+#include "isptar_misc.h"
+#include <sys/types.h>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+/// больше файлов заранее не открываем
+#define	PREFETCH_FILES	256
+/// столько чтений одновременно отдается io_uring
+#define	PREFETCH_DEPTH	32
+
+/**
+ * Чтение небольших файлов заранее в порядке их расположения на диске.
+ * Файлы ставятся в очередь в порядке архива, а фоновый поток читает их
+ * целиком в память, проходя по возрастанию физического адреса первого
+ * экстента (FIEMAP, без него - по номеру inode) и возвращаясь к началу,
+ * как лифт. Если ядро дает io_uring, поток держит в нем до PREFETCH_DEPTH
+ * чтений сразу, иначе читает по одному файлу. Take отдает данные в порядке
+ * очереди; если поток до файла еще не дошел, Take читает его сам
+ */
+namespace prefetch {
+using std::string;
+
+class Scheduler {
+public:
+	Scheduler();
+	~Scheduler();
+
+	/// прочитать заранее size байт файла с начала
+	void Add(const misc::ResHandle &fd, int64_t size, ino_t ino);
+	/// данные самого раннего из добавленных файлов
+	string Take();
+
+private:
+	struct File;
+	typedef std::shared_ptr<File> FilePtr;
+
+	std::deque<FilePtr> m_files;
+	size_t m_queued;
+	uint64_t m_last;
+	bool m_stop;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::thread m_thread;
+
+	void Run();
+	FilePtr Next();
+	void Done(const FilePtr &file);
+	static void Load(File &file);
+};
+} // end of prefetch namespace
+
+#endif
@@ -0,0 +1,263 @@
+#include "isptar_rules.h"
+#include "isptar_io.h"
+#include "isptar_misc.h"
+#include <fnmatch.h>
+#include <string.h>
+#include <stdexcept>
+#include <algorithm>
+#define	RULES_FNMATCH	(FNM_LEADING_DIR|FNM_EXTMATCH)
+
+namespace rules {
+Matcher::Matcher() : m_nodes(1), m_levels(false) {}
+
+void Matcher::Add(Action action, const string &_pattern, int level) {
+	//fnmatch не находит если слэш в конце
+	string pattern = _pattern;
+	if (!pattern.empty() && pattern[pattern.size() - 1] == '/')
+		pattern.resize(pattern.size() - 1);
+	Rule rule;
+	rule.action = action;
+	rule.level = level;
+	string prefix;
+	if (!Compile(pattern, rule, prefix)) {
+		rule.tokens.clear();
+		rule.fnmatch = pattern;
+	}
+	rule.start = prefix;
+	rule.prefix = prefix.size();
+	size_t node = 0;
+	ForEachI(prefix, ch) {
+		auto next = m_nodes[node].next.find(*ch);
+		if (next == m_nodes[node].next.end()) {
+			next = m_nodes[node].next.insert(std::make_pair((unsigned char)*ch, m_nodes.size())).first;
+			m_nodes.push_back(Node());
+		}
+		node = next->second;
+	}
+	m_nodes[node].rules.push_back(m_rules.size());
+	m_rules.push_back(rule);
+	m_levels |= action == LEVEL;
+}
+
+void Matcher::Load(const string &filename) {
+	io::FileIStream in(filename);
+	if (!in.fd())
+		throw std::runtime_error("Failed to open '" + filename + "'");
+	string data;
+	char buf[CHUNK];
+	int size;
+	while ((size = in.Read(buf, sizeof(buf))) > 0)
+		data.append(buf, size);
+	int num = 0;
+	while (!data.empty()) {
+		string line = misc::GetWord(data, '\n');
+		++num;
+		if (line.empty() || line[0] == '#')
+			continue;
+		const string action = misc::GetWord(line, ' ');
+		int level = 0;
+		if (action == "level") {
+			const string value = misc::GetWord(line, ' ');
+			if (value.empty() || value.find_first_not_of("0123456789") != string::npos)
+				line.clear();
+			level = misc::Int(value);
+		}
+		if (line.empty() || (action != "exclude" && action != "include" && action != "store" && action != "level"))
+			throw std::runtime_error("Bad rule at line " + misc::Str(num) + " of '" + filename + "'");
+		Add(action == "exclude" ? SKIP : action == "include" ? KEEP : LEVEL, line, level);
+	}
+}
+
+/**
+ * Разбор шаблона: prefix - буквальное начало, tokens - остальное. false,
+ * если шаблон понимает только fnmatch (extglob, классы [:alpha:] и т.п.)
+ */
+bool Matcher::Compile(const string &pattern, Rule &rule, string &prefix) const {
+	auto text = [&rule, &prefix](char ch) {
+		if (rule.tokens.empty()) {
+			prefix.push_back(ch);
+			return;
+		}
+		if (rule.tokens.back().type != Token::TEXT) {
+			rule.tokens.push_back(Token());
+			rule.tokens.back().type = Token::TEXT;
+		}
+		rule.tokens.back().text.push_back(ch);
+	};
+	for (size_t pos = 0; pos < pattern.size(); ) {
+		char ch = pattern[pos];
+		if (strchr("?*+@!", ch) && pos + 1 < pattern.size() && pattern[pos + 1] == '(')
+			return false;
+		if (ch == '\\') {
+			if (pos + 1 == pattern.size())
+				return false;
+			text(pattern[pos + 1]);
+			pos += 2;
+			continue;
+		}
+		if (ch != '*' && ch != '?' && ch != '[') {
+			text(ch);
+			++pos;
+			continue;
+		}
+		Token token;
+		token.type = ch == '*' ? Token::STAR : ch == '?' ? Token::ONE : Token::SET;
+		++pos;
+		if (token.type == Token::SET) {
+			bool negate = pos < pattern.size() && (pattern[pos] == '!' || pattern[pos] == '^');
+			if (negate)
+				++pos;
+			for (bool first = true; ; first = false) {
+				if (pos >= pattern.size())
+					return false;
+				unsigned char from = pattern[pos];
+				if (from == ']' && !first) {
+					++pos;
+					break;
+				}
+				if (from == '[' && pos + 1 < pattern.size() && strchr(":.=", pattern[pos + 1]))
+					return false;
+				if (from == '\\' && ++pos >= pattern.size())
+					return false;
+				from = pattern[pos++];
+				unsigned char to = from;
+				if (pos + 1 < pattern.size() && pattern[pos] == '-' && pattern[pos + 1] != ']') {
+					pos += 1;
+					if (pattern[pos] == '[' && pos + 1 < pattern.size() && strchr(":.=", pattern[pos + 1]))
+						return false;
+					if (pattern[pos] == '\\' && ++pos >= pattern.size())
+						return false;
+					to = pattern[pos++];
+				}
+				for (unsigned code = from; code <= to; ++code)
+					token.set.set(code);
+			}
+			if (negate)
+				token.set.flip();
+		}
+		// "**" то же, что "*"
+		if (token.type != Token::STAR || rule.tokens.empty() || rule.tokens.back().type != Token::STAR)
+			rule.tokens.push_back(token);
+	}
+	return true;
+}
+
+/**
+ * Путь совпадает с началом шаблона (это проверил trie), сверяем остаток.
+ * Перебор с возвратом только к последней '*': ее хватает для шаблонов
+ * без extglob. Как FNM_LEADING_DIR, конец шаблона может прийтись на '/'
+ */
+bool Matcher::Match(const Rule &rule, const string &filename) const {
+	if (!rule.fnmatch.empty())
+		return fnmatch(rule.fnmatch.c_str(), filename.c_str(), RULES_FNMATCH) == 0;
+	const std::vector<Token> &tokens = rule.tokens;
+	const size_t size = filename.size();
+	size_t pos = rule.prefix, token = 0, star = string::npos, from = 0;
+	// за '*' текст: сразу к месту, где он встречается
+	auto seek = [&]() {
+		if (token < tokens.size() && tokens[token].type == Token::TEXT)
+			from = pos = filename.find(tokens[token].text, pos);
+		return pos != string::npos;
+	};
+	while (true) {
+		if (token == tokens.size()) {
+			if (pos == size || filename[pos] == '/')
+				return true;
+		} else {
+			const Token &cur = tokens[token];
+			if (cur.type == Token::STAR) {
+				star = ++token;
+				from = pos;
+				if (!seek())
+					return false;
+				continue;
+			}
+			bool step = false;
+			if (cur.type == Token::TEXT) {
+				step = filename.compare(pos, cur.text.size(), cur.text) == 0;
+				if (step)
+					pos += cur.text.size();
+			} else if (pos < size && (cur.type == Token::ONE || cur.set.test((unsigned char)filename[pos]))) {
+				step = true;
+				++pos;
+			}
+			if (step) {
+				++token;
+				continue;
+			}
+		}
+		if (star == string::npos || from >= size)
+			return false;
+		pos = ++from;
+		token = star;
+		if (!seek())
+			return false;
+	}
+}
+
+/// правила, у которых буквальное начало совпало с путем, в порядке добавления
+void Matcher::Found(const string &filename, std::vector<size_t> &found) const {
+	size_t node = 0;
+	for (size_t pos = 0; ; ++pos) {
+		found.insert(found.end(), m_nodes[node].rules.begin(), m_nodes[node].rules.end());
+		if (pos == filename.size())
+			break;
+		auto next = m_nodes[node].next.find(filename[pos]);
+		if (next == m_nodes[node].next.end())
+			break;
+		node = next->second;
+	}
+	std::sort(found.begin(), found.end());
+}
+
+Result Matcher::Match(const string &filename) const {
+	Result res;
+	if (m_rules.empty())
+		return res;
+	std::vector<size_t> found;
+	Found(filename, found);
+	bool inclusion = false, level = !m_levels;
+	ForEachI(found, index) {
+		const Rule &rule = m_rules[*index];
+		if (rule.action == LEVEL ? level : inclusion)
+			continue;
+		if (!Match(rule, filename))
+			continue;
+		if (rule.action == LEVEL) {
+			res.level = rule.level;
+			level = true;
+		} else {
+			res.exclude = rule.action == SKIP;
+			inclusion = true;
+		}
+		if (inclusion && level)
+			break;
+	}
+	return res;
+}
+
+bool Matcher::Descend(const string &dir) const {
+	std::vector<size_t> found;
+	Found(dir, found);
+	// исключившее каталог правило подходит и ко всему внутри него
+	size_t skip = m_rules.size();
+	ForEachI(found, index)
+		if (m_rules[*index].action != LEVEL && Match(m_rules[*index], dir)) {
+			skip = *index;
+			break;
+		}
+	const string path = dir + '/';
+	for (size_t index = 0; index < skip; ++index) {
+		const Rule &rule = m_rules[index];
+		if (rule.action != KEEP)
+			continue;
+		// начало шаблона внутри каталога
+		if (rule.start.compare(0, path.size(), path) == 0)
+			return true;
+		// или после начала идет '*' и т.п., и до каталога дойти еще можно
+		if ((!rule.tokens.empty() || !rule.fnmatch.empty()) && path.compare(0, rule.start.size(), rule.start) == 0)
+			return true;
+	}
+	return false;
+}
+} // end of rules namespace
@@ -0,0 +1,83 @@
+#ifndef __ISPTAR_RULES_H__
+#define __ISPTAR_RULES_H__
+#include <string>
+#include <vector>
+#include <map>
+#include <bitset>
+
+/**
+ * Правила отбора файлов (исключить, включить, уровень сжатия), собранные
+ * один раз. Шаблоны те же, что у fnmatch(FNM_LEADING_DIR|FNM_EXTMATCH):
+ * совпадение с путем или с каталогом, в котором он лежит. Начало шаблона
+ * до первого спецсимвола кладется в trie, остаток компилируется в список
+ * токенов (*, ?, [...]); только extglob проверяется через fnmatch.
+ * Из правил, подошедших к пути, действует первое в порядке добавления:
+ * отдельно для exclude/include и отдельно для уровня сжатия
+ */
+namespace rules {
+using std::string;
+
+enum Action { SKIP, KEEP, LEVEL };
+
+/// итог правил для одного пути
+struct Result {
+	bool exclude;
+	/// уровень сжатия из правил, -1 - уровень архива
+	int level;
+	Result() : exclude(false), level(-1) {}
+};
+
+class Matcher {
+public:
+	Matcher();
+
+	/// level нужен только для LEVEL (0 - хранить без сжатия)
+	void Add(Action action, const string &pattern, int level = 0);
+	/**
+	 * Файл правил, по одному на строку: "exclude ШАБЛОН", "include ШАБЛОН",
+	 * "store ШАБЛОН" или "level N ШАБЛОН". Пустые строки и '#' пропускаются
+	 */
+	void Load(const string &filename);
+
+	/// можно звать из нескольких потоков
+	Result Match(const string &filename) const;
+	bool Exclude(const string &filename) const { return Match(filename).exclude; }
+	/**
+	 * Исключенный каталог dir: может ли include, добавленный раньше
+	 * исключившего его правила, подойти к чему-то внутри. Тогда в каталог
+	 * все равно заходят. Шаблоны с '*' и т.п. проверяются с запасом
+	 */
+	bool Descend(const string &dir) const;
+
+private:
+	struct Token {
+		enum Type { TEXT, ONE, STAR, SET } type;
+		string text;
+		std::bitset<256> set;
+	};
+	struct Rule {
+		Action action;
+		int level;
+		/// начало шаблона, лежащее в trie, и его длина
+		string start;
+		size_t prefix;
+		std::vector<Token> tokens;
+		/// непустой, если проверять приходится через fnmatch
+		string fnmatch;
+	};
+	struct Node {
+		std::map<unsigned char, size_t> next;
+		std::vector<size_t> rules;
+	};
+
+	std::vector<Rule> m_rules;
+	std::vector<Node> m_nodes;
+	bool m_levels;
+
+	bool Compile(const string &pattern, Rule &rule, string &prefix) const;
+	bool Match(const Rule &rule, const string &filename) const;
+	void Found(const string &filename, std::vector<size_t> &found) const;
+};
+} // end of rules namespace
+
+#endif
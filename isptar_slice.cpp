@@ -6,12 +6,43 @@
 #include <string.h>
 #include <unistd.h>
 #include <iostream>
+#include <mutex>
+#include <algorithm>
+
+#define	HELD_SLICES	2
 
 namespace slice {
 using misc::ResHandle;
 error::error(const string &what) : std::runtime_error(what) {}
 
-static bool Execute(string cmd, const string &filename, const string &context) {
+/// несколько IStream одного архива (параллельная распаковка) не должны качать slice одновременно
+static std::mutex open_mutex;
+/// последний slice архива и его номер: ищется один раз на все IStream архива
+static std::map<string, std::pair<string, int64_t> > last_slices;
+/// идущие фоновые загрузки slice: их может открыть любой IStream архива
+static std::map<string, pid_t> downloads;
+/**
+ * Скачанные slice и сколько IStream их держат (читают или ждут в окне
+ * prefetch). Копии IStream одного архива читают их по очереди, поэтому
+ * slice удаляется, только когда его отпустит последний
+ */
+static std::map<string, int> slice_users;
+
+/// под open_mutex: отпустить скачанный slice, последний удаляет его
+static void Release(const string &filename) {
+	auto users = slice_users.find(filename);
+	if (users == slice_users.end() || --users->second > 0)
+		return;
+	slice_users.erase(users);
+	auto pre = downloads.find(filename);
+	if (pre != downloads.end()) {
+		misc::Script::TryWait(pre->second);
+		downloads.erase(pre);
+	}
+	unlink(filename.c_str());
+}
+
+static misc::Script MakeScript(string cmd, const string &filename, const string &context) {
 	misc::Script script(cmd);
 	auto pos = filename.rfind('/');
 	script.AddParam('p', (pos == string::npos) ? "." : filename.substr(0, pos));
@@ -22,7 +53,11 @@ static bool Execute(string cmd, const string &filename, const string &context) {
 	script.AddParam('e', (pos == string::npos) ? "" : SLICE_SEP);
 	script.AddParam('c', context);
 	script.AddParam('b', (pos == string::npos) ? name : name.substr(0, pos));
-	return script.Do();
+	return script;
+}
+
+static bool Execute(string cmd, const string &filename, const string &context) {
+	return MakeScript(cmd, filename, context).Do();
 }
 
 static ResHandle LockSlice(const string &filename) {
@@ -35,13 +70,135 @@ static ResHandle LockSlice(const string &filename) {
 	return fd;
 }
 
+/// очередь рабочего потока, см. OpenQueue::Worker
+static thread_local OpenQueue *worker_queue = NULL;
+
+struct OpenQueue::Request {
+	string filename;
+	ResHandle fd;
+	int error;
+	std::exception_ptr fail;
+	bool done;
+};
+
+OpenQueue::OpenQueue() : m_stop(false) {}
+
+OpenQueue::~OpenQueue() { Stop(); }
+
+void OpenQueue::Serve() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	Serve(lock);
+}
+
+void OpenQueue::ServeUntil(const std::function<bool()> &done) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		Serve(lock);
+		if (done())
+			return;
+		m_cond.wait(lock);
+	}
+}
+
+void OpenQueue::Notify() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_cond.notify_all();
+}
+
+void OpenQueue::Stop() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_stop = true;
+	m_cond.notify_all();
+}
+
+/// под m_mutex: открыть slice по всем запросам
+void OpenQueue::Serve(std::unique_lock<std::mutex> &lock) {
+	if (m_requests.empty())
+		return;
+	while (!m_requests.empty()) {
+		Request *req = m_requests.front();
+		m_requests.pop_front();
+		lock.unlock();
+		try {
+			req->fd = LockSlice(req->filename);
+			req->error = errno;
+		} catch (...) {
+			req->fail = std::current_exception();
+		}
+		lock.lock();
+		req->done = true;
+	}
+	m_cond.notify_all();
+}
+
+ResHandle OpenQueue::Open(const string &filename) {
+	Request req;
+	req.filename = filename;
+	req.error = 0;
+	req.done = false;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_requests.push_back(&req);
+	m_cond.notify_all();
+	// запрос, который основной поток уже открывает, дожидаемся и после Stop
+	auto queued = [this, &req] { return std::find(m_requests.begin(), m_requests.end(), &req) != m_requests.end(); };
+	m_cond.wait(lock, [this, &req, &queued] { return req.done || (m_stop && queued()); });
+	if (!req.done) {
+		m_requests.erase(std::find(m_requests.begin(), m_requests.end(), &req));
+		throw error("Failed to open '" + filename + "': extraction stopped");
+	}
+	if (req.fail)
+		std::rethrow_exception(req.fail);
+	errno = req.error;
+	return req.fd;
+}
+
+OpenQueue::Worker::Worker(OpenQueue &queue) { worker_queue = &queue; }
+
+OpenQueue::Worker::~Worker() { worker_queue = NULL; }
+
+/**
+ * Под open_mutex (lock): открыть slice сразу или, в рабочем потоке, через
+ * основной. Пока основной поток открывает, open_mutex отпускается: он сам
+ * может ждать open_mutex, читая листинг
+ */
+static ResHandle OpenSlice(const string &filename, std::unique_lock<std::mutex> &lock) {
+	if (!worker_queue)
+		return LockSlice(filename);
+	lock.unlock();
+	ResHandle fd;
+	try {
+		fd = worker_queue->Open(filename);
+	} catch (...) {
+		lock.lock();
+		throw;
+	}
+	int err = errno;
+	lock.lock();
+	errno = err;
+	return fd;
+}
+
 OStream::OStream(const string &name, int64_t slice_size)
 	: m_file(name)
+	, m_buffer(m_file)
+	, m_offset(0)
 	, m_filename(name)
 	, m_slice_size(slice_size)
-	, m_slice_id(1) { }
+	, m_slice_id(1)
+	, m_jobs(0) {
+	if (io::DirectWrite())
+		m_direct.reset(new io::DirectOStream(m_file.fd()));
+}
+
+OStream::~OStream() {
+	// сюда попадаем с ошибкой, результат загрузок уже не важен
+	ForEachI(m_uploads, pid)
+		misc::Script::TryWait(*pid);
+}
 
 void OStream::Finish() {
+	Flush();
+	WaitUploads(0);
 	if (!m_command.empty())
 		if (!Execute(m_command, m_slice_id > 1
 			? m_filename + SLICE_SEP + misc::Str(m_slice_id)
@@ -49,28 +206,49 @@ void OStream::Finish() {
 			throw error("Failed to upload data");
 }
 
-void OStream::Write(const char *buf, int size) {
-	int64_t left = m_slice_size - m_file.Offset();
+void OStream::Write(const char *buf, int64_t size) {
+	int64_t left = m_slice_size - m_offset;
 	while (left < size) {
-		m_file.Write(buf, left);
+		Put(buf, left);
+		Flush();
 		misc::Su su;
 		if (m_slice_id == 1)
 			rename(m_filename.c_str(), (m_filename + SLICE_SEP "1").c_str());
-		if (!m_command.empty()) {
-			if (!Execute(m_command, m_filename + SLICE_SEP + misc::Str(m_slice_id), "operation"))
-				throw error("Failed to upload data");
-		}
+		if (!m_command.empty())
+			Upload(m_filename + SLICE_SEP + misc::Str(m_slice_id));
 		const std::string filename = m_filename + SLICE_SEP + misc::Str(++m_slice_id);
 		m_file.Reset(open(filename.c_str(), O_CREAT|O_TRUNC|O_LARGEFILE|O_WRONLY, 0666));
+		if (m_direct)
+			m_direct->Reset(m_file.fd());
+		m_offset = 0;
 		size -= left;
 		buf += left;
 		left = m_slice_size;
 	}
-	m_file.Write(buf, size);
+	Put(buf, size);
+	m_offset += size;
+}
+
+void OStream::Put(const char *buf, int64_t size) {
+	if (m_direct) {
+		m_direct->Write(buf, size);
+	} else {
+		m_buffer.Write(buf, size);
+		m_file.Drop(false);
+	}
+}
+
+void OStream::Flush() {
+	if (m_direct) {
+		m_direct->Flush();
+	} else {
+		m_buffer.Flush();
+		m_file.Drop(true);
+	}
 }
 
 Offs OStream::Offset() const {
-	return std::make_pair(m_slice_id, m_file.Offset());
+	return std::make_pair(m_slice_id, m_offset);
 }
 
 int64_t OStream::Size(Offs start) {
@@ -81,34 +259,153 @@ int64_t OStream::Size(Offs start) {
 
 void OStream::SetUpload(const string &command) { m_command = command; }
 
+void OStream::SetUploadJobs(int jobs) { m_jobs = jobs; }
+
+void OStream::Upload(const string &filename) {
+	if (m_jobs <= 0) {
+		if (!Execute(m_command, filename, "operation"))
+			throw error("Failed to upload data");
+		return;
+	}
+	WaitUploads(m_jobs - 1);
+	m_uploads.push_back(MakeScript(m_command, filename, "operation").Start());
+}
+
+void OStream::WaitUploads(size_t limit) {
+	while (m_uploads.size() > limit) {
+		pid_t pid = m_uploads.front();
+		m_uploads.pop_front();
+		if (!misc::Script::Wait(pid))
+			throw error("Failed to upload data");
+	}
+}
+
 IStream::IStream(const string &name)
 	: m_filename(name)
-	, m_slice_id(0) { }
+	, m_slice_id(0)
+	, m_prefetch_count(0) { }
+
+IStream::~IStream() {
+	std::lock_guard<std::mutex> lock(open_mutex);
+	DropPrefetch(0, 0);
+	ReleaseHeld(0);
+}
 
-IStream::~IStream() { DeleteLast(); }
+/// под open_mutex: отпустить старые скачанные slice, кроме keep последних
+void IStream::ReleaseHeld(size_t keep) {
+	while (m_held.size() > keep) {
+		Release(m_held.front());
+		m_held.pop_front();
+	}
+}
 
-void IStream::DeleteLast() {
-	if (!m_last.empty())
-		unlink(m_last.c_str());
+/// под open_mutex: держать скачанный slice filename, пока он читается
+void IStream::Hold(const string &filename) {
+	auto held = std::find(m_held.begin(), m_held.end(), filename);
+	if (held != m_held.end())
+		m_held.erase(held);
+	else
+		++slice_users[filename];
+	m_held.push_back(filename);
+	ReleaseHeld(HELD_SLICES);
 }
 
 void IStream::SetDownload(const string &command) { m_command = command; }
 
+void IStream::SetPrefetch(int count) { m_prefetch_count = count; }
+
 misc::ResHandle IStream::Open(const string &filename) {
-	misc::ResHandle fd = LockSlice(filename);
-	if (!fd && errno == ENOENT) {
+	std::unique_lock<std::mutex> lock(open_mutex);
+	bool prefetched = WaitPrefetch(filename);
+	misc::ResHandle fd;
+	if (!prefetched) {
+		fd = OpenSlice(filename, lock);
+		// пока open_mutex был отпущен, slice мог скачать другой IStream
+		if (!fd && errno == ENOENT && (WaitPrefetch(filename) || slice_users.count(filename)))
+			prefetched = true;
+	}
+	if (!fd && (prefetched || errno == ENOENT)) {
 		if (m_command.empty())
 			return misc::ResHandle();
-		DeleteLast();
-		Execute(m_command, filename, "operation");
-		fd = LockSlice(filename);
+		if (!prefetched) {
+			ReleaseHeld(HELD_SLICES - 1);
+			Execute(m_command, filename, "operation");
+			Hold(filename);
+		}
+		fd = OpenSlice(filename, lock);
 		if (!fd)
 			return misc::ResHandle();
-		m_last = filename;
 	}
+	if (fd && slice_users.count(filename))
+		Hold(filename);
+	if (fd && !m_command.empty() && m_prefetch_count > 0)
+		Prefetch();
 	return fd;
 }
 
+/**
+ * Пока читается текущий slice, следующие m_prefetch_count скачиваются в фоне.
+ * Скачанные заранее, но оказавшиеся не нужны (после Seek) удаляются. Возврат
+ * в предыдущий slice (см. m_held) окно не укорачивает.
+ * Вызывается под open_mutex
+ */
+void IStream::Prefetch() {
+	DropPrefetch(m_slice_id + 1, m_slice_id + m_prefetch_count + HELD_SLICES - 1);
+	for (int64_t id = m_slice_id + 1; id <= m_slice_id + m_prefetch_count; ++id) {
+		const string filename = m_filename + SLICE_SEP + misc::Str(id);
+		if (m_prefetch.count(id))
+			continue;
+		// уже скачанный или скачиваемый другим IStream slice держим вместе с ним
+		if (!slice_users.count(filename)) {
+			if (access(filename.c_str(), F_OK) == 0)
+				continue;
+			downloads[filename] = MakeScript(m_command, filename, "operation").Start();
+		}
+		++slice_users[filename];
+		m_prefetch.insert(id);
+	}
+}
+
+/// под open_mutex: дождаться фоновой загрузки filename, если она идет
+bool IStream::WaitPrefetch(const string &filename) {
+	auto pre = downloads.find(filename);
+	if (pre == downloads.end())
+		return false;
+	bool done = misc::Script::Wait(pre->second);
+	downloads.erase(pre);
+	if (!done) {
+		unlink(filename.c_str());
+		throw error("Failed to download '" + filename + "'");
+	}
+	return true;
+}
+
+/// под open_mutex: дождаться всех фоновых загрузок slice этого архива
+void IStream::WaitDownloads() {
+	const string prefix = m_filename + SLICE_SEP;
+	for (auto pre = downloads.begin(); pre != downloads.end(); ) {
+		if (pre->first.compare(0, prefix.size(), prefix) != 0) {
+			++pre;
+			continue;
+		}
+		if (!misc::Script::Wait(pre->second))
+			unlink(pre->first.c_str());
+		downloads.erase(pre++);
+	}
+}
+
+/// под open_mutex: отпустить slice своего окна prefetch вне first..last
+void IStream::DropPrefetch(int64_t first, int64_t last) {
+	for (auto id = m_prefetch.begin(); id != m_prefetch.end(); ) {
+		if (*id >= first && *id <= last) {
+			++id;
+			continue;
+		}
+		Release(m_filename + SLICE_SEP + misc::Str(*id));
+		m_prefetch.erase(id++);
+	}
+}
+
 int64_t IStream::LookupLastSlice(const string &folder, const string &name) {
 	int64_t res = -1;
 	struct dirent entry, *result;
@@ -125,8 +422,27 @@ int64_t IStream::LookupLastSlice(const string &folder, const string &name) {
 }
 
 void IStream::OpenLast() {
+	std::unique_lock<std::mutex> lock(open_mutex);
+	// повторные Seek(SEEK_END), в том числе из копий IStream, обходятся без readdir
+	auto last = last_slices.find(m_filename);
+	if (last != last_slices.end()) {
+		const auto cached = last->second;
+		WaitPrefetch(cached.first);
+		misc::ResHandle fd = OpenSlice(cached.first, lock);
+		if (fd) {
+			if (slice_users.count(cached.first))
+				Hold(cached.first);
+			m_slice_id = cached.second;
+			m_file.Reset(fd);
+			return;
+		}
+	}
+	// недокачанные заранее slice не должны попасть в поиск последнего
+	DropPrefetch(0, 0);
+	WaitDownloads();
 	m_slice_id = 1;
-	misc::ResHandle fd = LockSlice(m_filename);
+	string last_slice = m_filename;
+	misc::ResHandle fd = OpenSlice(m_filename, lock);
 	if (!fd) {
 		auto pos = m_filename.rfind('/');
 		const string folder = (pos == string::npos) ? "." : m_filename.substr(0, pos);
@@ -139,20 +455,22 @@ void IStream::OpenLast() {
 			m_slice_id = LookupLastSlice(folder, name);
 			if (m_slice_id == -1)
 				throw error("File not found slice -1 folder: " + folder + "name: " + name);
-			m_last = m_slice_id > 0 ? m_filename + SLICE_SEP + misc::Str(m_slice_id) : m_filename;
-			fd = LockSlice(m_last);
+			last_slice = m_slice_id > 0 ? m_filename + SLICE_SEP + misc::Str(m_slice_id) : m_filename;
+			Hold(last_slice);
+			fd = OpenSlice(last_slice, lock);
 			if (!fd)
 				throw error("File not found no fd");
 		} else {
-			const string filename = m_filename + SLICE_SEP + misc::Str(m_slice_id);
-			fd = LockSlice(filename);
+			last_slice = m_filename + SLICE_SEP + misc::Str(m_slice_id);
+			fd = OpenSlice(last_slice, lock);
 		}
 	}
+	last_slices[m_filename] = std::make_pair(last_slice, m_slice_id);
 	m_file.Reset(fd);
 }
 
-int IStream::Read(char *buf, int size) {
-	int have = m_file.Read(buf, size);
+int64_t IStream::Read(char *buf, int64_t size) {
+	int64_t have = m_file.Read(buf, size);
 	if (have != 0)
 		return have;
 	auto fd = Open(m_filename + SLICE_SEP + misc::Str(++m_slice_id));
@@ -162,6 +480,8 @@ int IStream::Read(char *buf, int size) {
 	return m_file.Read(buf, size);
 }
 
+Offs IStream::Tell() { return std::make_pair(m_slice_id, m_file.Seek(0, SEEK_CUR)); }
+
 Offs IStream::Seek(int64_t file, int64_t pos, int whence) {
 	if (whence == SEEK_SET) {
 		if (file != m_slice_id) {
@@ -2,6 +2,13 @@
 #define __ISPTAR_SLICE_H__
 #include "isptar_io.h"
 #include <stdexcept>
+#include <deque>
+#include <map>
+#include <set>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
 #define	SLICE_SEP	".part"
 
 namespace slice {
@@ -15,19 +22,75 @@ public:
 class OStream : public io::OStream {
 public:
 	OStream(const string &name, int64_t slice_size);
+	~OStream();
 	void Finish();
 
-	virtual void Write(const char *buf, int size);
+	/// запись буферизуется, в файлы slice данные попадают при переходе к следующему и в Finish
+	virtual void Write(const char *buf, int64_t size);
 	Offs Offset() const;
 	void SetUpload(const string &script);
+	/// загружать заполненные slice в фоне, не больше jobs одновременно
+	void SetUploadJobs(int jobs);
 	int64_t Size(Offs start);
 
 private:
 	io::FileOStream m_file;
+	io::BufferedOStream m_buffer;
+	std::unique_ptr<io::DirectOStream> m_direct;
+	/// смещение в текущем slice вместе с буфером
+	int64_t m_offset;
 	const string m_filename;
 	int64_t m_slice_size;
 	int64_t m_slice_id;
 	string m_command;
+	int m_jobs;
+	std::deque<pid_t> m_uploads;
+
+	void Put(const char *buf, int64_t size);
+	/// записать буфер в конец текущего slice
+	void Flush();
+	void Upload(const string &filename);
+	void WaitUploads(size_t limit);
+};
+
+/**
+ * Открытие slice из рабочих потоков через основной. euid общий для всех
+ * потоков процесса, поэтому переключать его (misc::Su) может только основной
+ * поток: рабочий под Worker ставит запрос в очередь и ждет, пока основной
+ * не откроет slice в Serve или ServeUntil
+ */
+class OpenQueue {
+public:
+	OpenQueue();
+	~OpenQueue();
+
+	/// основной поток: открыть уже запрошенные slice
+	void Serve();
+	/// основной поток: открывать запрошенные slice, пока done() не вернет true
+	void ServeUntil(const std::function<bool()> &done);
+	/// рабочий поток: условие ServeUntil могло измениться
+	void Notify();
+	/// основной поток больше не обслуживает очередь, ждущие получают ошибку
+	void Stop();
+
+	/// пока объект жив, IStream этого потока открывают slice через очередь
+	class Worker {
+	public:
+		Worker(OpenQueue &queue);
+		~Worker();
+	};
+
+	/// рабочий поток: открыть slice через основной
+	misc::ResHandle Open(const string &filename);
+
+private:
+	struct Request;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque<Request *> m_requests;
+	bool m_stop;
+
+	void Serve(std::unique_lock<std::mutex> &lock);
 };
 
 class IStream : public io::IStream {
@@ -35,20 +98,36 @@ public:
 	IStream(const string &name);
 	virtual ~IStream();
 
-	virtual int Read(char *buf, int size);
+	virtual int64_t Read(char *buf, int64_t size);
 	Offs Seek(int64_t file, int64_t pos, int whence);
+	/// текущая позиция: slice и смещение в нем
+	Offs Tell();
 	void SetDownload(const string &script);
+	/// скачивать в фоне count следующих slice
+	void SetPrefetch(int count);
 
 private:
 	io::FileIStream m_file;
 	const string m_filename;
 	int64_t m_slice_id;
 	string m_command;
-	string m_last;
+	/**
+	 * Скачанные slice, которые держит этот IStream: текущий и предыдущий,
+	 * member на границе slice читается с возвратом в предыдущий
+	 */
+	std::deque<string> m_held;
+	int m_prefetch_count;
+	/// номера slice окна prefetch, которые держит этот IStream
+	std::set<int64_t> m_prefetch;
 
 	io::ResHandle Open(const string &filename);
+	void Prefetch();
+	bool WaitPrefetch(const string &filename);
+	void WaitDownloads();
+	void DropPrefetch(int64_t first, int64_t last);
 	void OpenLast();
-	void DeleteLast();
+	void ReleaseHeld(size_t keep);
+	void Hold(const string &filename);
 	static int64_t LookupLastSlice(const string &folder, const string &name);
 };
 } // end of slice namespace
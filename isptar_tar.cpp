@@ -1,6 +1,7 @@
 #include "isptar_tar.h"
 #include <string.h>
 #include <sys/types.h>
+#include <sys/sysmacros.h>
 #include <pwd.h>
 #include <grp.h>
 #include <fcntl.h>
@@ -108,46 +109,116 @@ FileInfo & FileInfo::Set(const string &name, struct stat &sb) {
 	return *this;
 }
 
+/// очередное поле строки листинга, pos переходит за табуляцию
+static const char * Field(const char *&pos, const char *end) {
+	const char *tab = (const char *)memchr(pos, '\t', end - pos);
+	pos = tab ? tab + 1 : end;
+	return tab ? tab : end;
+}
+
+/// десятичное число, как его пишет misc::Str
+static int64_t Number(const char *pos, const char *end) {
+	bool negative = pos < end && *pos == '-';
+	if (negative)
+		++pos;
+	int64_t res = 0;
+	for (; pos < end && *pos >= '0' && *pos <= '9'; ++pos)
+		res = res * 10 + (*pos - '0');
+	return negative ? -res : res;
+}
+
+/// DecodeFileName без промежуточных строк: результат пишется в res
+static void DecodeName(const char *pos, const char *end, string &res) {
+	const char *slash = (const char *)memchr(pos, '\\', end - pos);
+	if (!slash) {
+		res.assign(pos, end - pos);
+		return;
+	}
+	res.assign(pos, slash - pos);
+	for (pos = slash; pos < end; ++pos) {
+		if (*pos != '\\') {
+			res.push_back(*pos);
+			continue;
+		}
+		if (pos + 1 < end && pos[1] == '\\')
+			res.push_back('\\');
+		else if (pos + 1 < end && pos[1] == 't')
+			res.push_back('\t');
+		else if (pos + 1 < end && pos[1] == 'n')
+			res.push_back('\n');
+		else
+			throw std::runtime_error("Bad encoded filename '" + string(pos, end) + "'");
+		++pos;
+	}
+}
+
+/// "имя#id"; без '#' все поле считается id, как у misc::RGetWord
+static void Owner(const char *pos, const char *end, string &name, int &id) {
+	const char *hash = (const char *)memrchr(pos, '#', end - pos);
+	if (hash) {
+		name.assign(pos, hash - pos);
+		pos = hash + 1;
+	} else
+		name.clear();
+	id = Number(pos, end);
+}
+
+static bool IsWord(const char *pos, const char *end, const char *word) {
+	size_t len = strlen(word);
+	return (size_t)(end - pos) == len && memcmp(pos, word, len) == 0;
+}
+
 FileInfo & FileInfo::Set(string &line) {
-	filename = DecodeFileName(misc::GetWord(line, '\t'));
-	user = misc::GetWord(line, '\t');
-	uid = misc::Int(misc::RGetWord(user, '#'));
-	group = misc::GetWord(line, '\t');
-	gid = misc::Int(misc::RGetWord(group, '#'));
-	mode = misc::Int(misc::GetWord(line, '\t'));
+	const char *tail = Set(line.data(), line.data() + line.size());
+	line.erase(0, tail - line.data());
+	return *this;
+}
+
+const char * FileInfo::Set(const char *pos, const char *end) {
+	const char *start = pos;
+	const char *field_end = Field(pos, end);
+	DecodeName(start, field_end, filename);
+	start = pos;
+	field_end = Field(pos, end);
+	Owner(start, field_end, user, uid);
+	start = pos;
+	field_end = Field(pos, end);
+	Owner(start, field_end, group, gid);
+	start = pos;
+	mode = Number(start, Field(pos, end));
 	size = 0;
 	linkname.clear();
 	devmajor = 0;
 	devminor = 0;
 	time = 0;
 
-	string stype = misc::GetWord(line, '\t');
-	if (stype == "file") {
+	const char *stype = pos;
+	const char *stype_end = Field(pos, end);
+	if (IsWord(stype, stype_end, "file")) {
 		type = REGTYPE;
-		time = misc::Int(misc::GetWord(line, '\t'));
-		size = misc::Int(misc::GetWord(line, '\t'));
-	} else if (stype == "dir") {
+		start = pos;
+		time = Number(start, Field(pos, end));
+		start = pos;
+		size = Number(start, Field(pos, end));
+	} else if (IsWord(stype, stype_end, "dir")) {
 		type = DIRTYPE;
-	} else if (stype == "link") {
-		type = SYMTYPE;
-		linkname = DecodeFileName(misc::GetWord(line, '\t'));
-	} else if (stype == "hard") {
-		type = LNKTYPE;
-		linkname = DecodeFileName(misc::GetWord(line, '\t'));
-	} else if (stype == "char") {
-		type = CHRTYPE;
-		devmajor = misc::Int(misc::GetWord(line, '\t'));
-		devminor = misc::Int(misc::GetWord(line, '\t'));
-	} else if (stype == "block") {
-		type = BLKTYPE;
-		devmajor = misc::Int(misc::GetWord(line, '\t'));
-		devminor = misc::Int(misc::GetWord(line, '\t'));
-	} else if (stype == "fifo") {
+	} else if (IsWord(stype, stype_end, "link") || IsWord(stype, stype_end, "hard")) {
+		type = *stype == 'l' ? SYMTYPE : LNKTYPE;
+		start = pos;
+		field_end = Field(pos, end);
+		DecodeName(start, field_end, linkname);
+	} else if (IsWord(stype, stype_end, "char") || IsWord(stype, stype_end, "block")) {
+		type = *stype == 'c' ? CHRTYPE : BLKTYPE;
+		start = pos;
+		devmajor = Number(start, Field(pos, end));
+		start = pos;
+		devminor = Number(start, Field(pos, end));
+	} else if (IsWord(stype, stype_end, "fifo")) {
 		type = FIFOTYPE;
 	} else {
 		type = AREGTYPE;
 	}
-	return *this;
+	return pos;
 }
 
 string FileInfo::Str() const {
@@ -188,19 +259,47 @@ static void SetOwnerMode(int fd, int uid, int gid, int mode, const string &name)
 		throw std::runtime_error("Failed to set file owner " + name);
 }
 
-misc::ResHandle FileInfo::Create(const string &prefix, io::IStream &in) {
+misc::ResHandle FileInfo::Create(const string &prefix, io::IStream &in, const string &extents) {
 	auto fd = Create(prefix);
-	char buf[CHUNK];
-	auto left = size;
-	io::FileOStream out(fd);
-	while (left > 0) {
-		int len = left > sizeof(buf) ? sizeof(buf) : left;
-		int size = in.Read(buf, len);
+	Fill(fd, in, extents);
+	return fd;
+}
+
+/// перенести length байт из in в out, без out данные только пропускаются
+static void CopyData(io::IStream &in, io::FileOStream *out, int64_t length) {
+	std::vector<char> buf(std::min(length, (int64_t)io::BufferSize()));
+	while (length > 0) {
+		int64_t size = in.Read(&buf[0], std::min(length, (int64_t)buf.size()));
 		if (size <= 0)
 			throw std::runtime_error("Failed to get data");
-		out.Write(buf, size);
-		left -= size;
+		if (out) {
+			out->Write(&buf[0], size);
+			out->Drop(false);
+		}
+		length -= size;
 	}
+}
+
+void FileInfo::Fill(const io::ResHandle &fd, io::IStream &in, const string &extents) const {
+	io::FileOStream out(fd);
+	if (extents.empty() || !fd) {
+		CopyData(in, &out, size);
+	} else {
+		// нули на месте дыр распаковываются вхолостую, а в файле пропускаются
+		int64_t pos = 0;
+		auto data = io::ParseExtents(extents);
+		ForEachI(data, extent) {
+			CopyData(in, NULL, extent->first - pos);
+			if (lseek64(fd, extent->first, SEEK_SET) == -1)
+				throw std::runtime_error("Failed to seek in file");
+			CopyData(in, &out, extent->second);
+			pos = extent->first + extent->second;
+		}
+		CopyData(in, NULL, size - pos);
+		if (ftruncate64(fd, size))
+			throw std::runtime_error("Failed to set file size");
+	}
+	out.DropLater();
 	if (fd) {
 		struct timeval tv[2];
 		tv[0].tv_sec = ::time(NULL);
@@ -210,7 +309,6 @@ misc::ResHandle FileInfo::Create(const string &prefix, io::IStream &in) {
 		if (futimes(fd, tv))
 			throw std::runtime_error("Failed to set utimes");
 	}
-	return fd;
 }
 
 misc::ResHandle FileInfo::Create(const string &prefix) {
@@ -514,17 +612,19 @@ void Writer::WriteTail(bool finish) {
 }
 
 void Writer::WriteData(io::IStream &in) {
-	char buf[1024];
-	while (int len = DataLeft(sizeof(buf))) {
-		len = in.Read(buf, len);
+	// буфер растет до размера самого большого файла, но не больше io::BufferSize
+	if (m_buf.size() < (size_t)DataLeft(io::BufferSize()))
+		m_buf.resize(DataLeft(io::BufferSize()));
+	while (int64_t len = DataLeft(m_buf.size())) {
+		len = in.Read(&m_buf[0], len);
 		if (len <= 0)
 			break;
-		m_out.Write(buf, len);
+		m_out.Write(&m_buf[0], len);
 		m_left -= len;
 	}
 }
 
-int64_t Writer::DataLeft(int buffer_size) const {
+int64_t Writer::DataLeft(int64_t buffer_size) const {
 	return (buffer_size != -1 && buffer_size < m_left) ? buffer_size : m_left;
 }
 
@@ -532,6 +632,11 @@ void Writer::AddDone(int64_t done) {
 	m_left -= done;
 }
 
+void Writer::Skip() {
+	m_left = 0;
+	m_tail = 0;
+}
+
 void Writer::LongLink(const FileInfo &info, string value, char type) {
 	value.push_back('\0');
 	FileInfo longlink;
@@ -33,9 +33,21 @@ public:
 	FileInfo();
 	FileInfo & Set(const string &name, struct stat &sb);
 	FileInfo & Set(string &line);
+	/**
+	 * разбор строки листинга [pos, end) без промежуточных строк, поля
+	 * пишутся в уже выделенную память. Возвращает начало хвоста строки
+	 * (позиция и атрибуты)
+	 */
+	const char * Set(const char *pos, const char *end);
 	string Str() const;
 	io::ResHandle Create(const string &prefix);
-	io::ResHandle Create(const string &prefix, io::IStream &in);
+	io::ResHandle Create(const string &prefix, io::IStream &in, const string &extents = "");
+	/**
+	 * записать данные в уже созданный файл и выставить ему время. Для
+	 * разреженного файла extents - его участки данных (io::ExtentsStr),
+	 * остальное остается дырами
+	 */
+	void Fill(const io::ResHandle &fd, io::IStream &in, const string &extents = "") const;
 
 	string GetUserName();
 	string GetGroupName();
@@ -62,13 +74,16 @@ public:
 	void WriteData(const string &value);
 	void WriteData(io::IStream &in);
 	void WriteTail(bool finish = false);
-	int64_t DataLeft(int buffer_size = -1) const;
+	int64_t DataLeft(int64_t buffer_size = -1) const;
 	void AddDone(int64_t done);
+	/// данные текущего файла вместе с выравниванием записаны в обход Writer
+	void Skip();
 
 private:
 	io::OStream &m_out;
 	int64_t m_left;
 	int m_tail;
+	std::vector<char> m_buf;
 
 	void LongLink(const FileInfo &info, string value, char type);
 };
@@ -0,0 +1,51 @@
+#include "isptar_thread.h"
+#include "isptar_misc.h"
+
+namespace thread {
+Pool::Pool(int size) : m_stop(false) {
+	for (int i = 0; i < size; ++i)
+		m_threads.push_back(std::thread(&Pool::Run, this));
+}
+
+Pool::~Pool() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+		m_tasks.clear();
+	}
+	m_cond.notify_all();
+	ForEachI(m_threads, th)
+		th->join();
+}
+
+std::future<void> Pool::Add(const Task &task) {
+	auto res = std::make_shared< std::packaged_task<void()> >(task);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_tasks.push_back(res);
+	}
+	m_cond.notify_one();
+	return res->get_future();
+}
+
+int Pool::size() const { return m_threads.size(); }
+
+void Pool::Run() {
+	while (true) {
+		std::shared_ptr< std::packaged_task<void()> > task;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cond.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+			if (m_stop)
+				return;
+			task = m_tasks.front();
+			m_tasks.pop_front();
+		}
+		(*task)();
+	}
+}
+
+bool Ready(const std::future<void> &res) {
+	return res.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+} // end of thread namespace
@@ -0,0 +1,39 @@
+#ifndef __ISPTAR_THREAD_H__
+#define __ISPTAR_THREAD_H__
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <vector>
+#include <deque>
+
+namespace thread {
+typedef std::function<void()> Task;
+
+/**
+ * Пул рабочих потоков. Задачи выполняются в порядке поступления, результат
+ * (и исключение) задачи можно получить через возвращаемый future
+ */
+class Pool {
+public:
+	Pool(int size);
+	~Pool();
+
+	std::future<void> Add(const Task &task);
+	int size() const;
+
+private:
+	std::vector<std::thread> m_threads;
+	std::deque< std::shared_ptr< std::packaged_task<void()> > > m_tasks;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	bool m_stop;
+
+	void Run();
+};
+
+bool Ready(const std::future<void> &res);
+} // end of thread namespace
+
+#endif
@@ -0,0 +1,120 @@
+#include "isptar_uring.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdexcept>
+#include <algorithm>
+
+namespace uring {
+Ring::Ring(unsigned entries)
+	: m_fd(-1)
+	, m_sq(MAP_FAILED)
+	, m_sq_size(0)
+	, m_cq(MAP_FAILED)
+	, m_cq_size(0)
+	, m_sqes((struct io_uring_sqe *)MAP_FAILED)
+	, m_sqes_size(0)
+	, m_pending(0) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	m_fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (m_fd < 0)
+		throw std::runtime_error("io_uring is not available");
+	m_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+	m_sq = mmap(NULL, m_sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+	if (m_sq == MAP_FAILED) {
+		Close();
+		throw std::runtime_error("Failed to map io_uring");
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		m_cq = m_sq;
+	} else {
+		m_cq = mmap(NULL, m_cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+		if (m_cq == MAP_FAILED) {
+			Close();
+			throw std::runtime_error("Failed to map io_uring");
+		}
+	}
+	m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	m_sqes = (struct io_uring_sqe *)mmap(NULL, m_sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_fd, IORING_OFF_SQES);
+	if (m_sqes == MAP_FAILED) {
+		Close();
+		throw std::runtime_error("Failed to map io_uring");
+	}
+	char *sq = (char *)m_sq;
+	m_sq_head = (unsigned *)(sq + params.sq_off.head);
+	m_sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	m_sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	m_sq_entries = *(unsigned *)(sq + params.sq_off.ring_entries);
+	m_sq_array = (unsigned *)(sq + params.sq_off.array);
+	char *cq = (char *)m_cq;
+	m_cq_head = (unsigned *)(cq + params.cq_off.head);
+	m_cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	m_cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+	m_cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+}
+
+Ring::~Ring() { Close(); }
+
+void Ring::Close() {
+	if (m_sqes != MAP_FAILED)
+		munmap(m_sqes, m_sqes_size);
+	if (m_cq != MAP_FAILED && m_cq != m_sq)
+		munmap(m_cq, m_cq_size);
+	if (m_sq != MAP_FAILED)
+		munmap(m_sq, m_sq_size);
+	if (m_fd >= 0)
+		close(m_fd);
+	m_sqes = (struct io_uring_sqe *)MAP_FAILED;
+	m_sq = m_cq = MAP_FAILED;
+	m_fd = -1;
+}
+
+bool Ring::Read(int fd, const struct iovec *iov, uint64_t offset, uint64_t data) {
+	unsigned tail = *m_sq_tail;
+	if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries)
+		return false;
+	unsigned index = tail & m_sq_mask;
+	struct io_uring_sqe *sqe = &m_sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)iov;
+	sqe->len = 1;
+	sqe->off = offset;
+	sqe->user_data = data;
+	m_sq_array[index] = index;
+	__atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++m_pending;
+	return true;
+}
+
+void Ring::Submit(unsigned wait) {
+	while (true) {
+		int res = syscall(__NR_io_uring_enter, m_fd, m_pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (res >= 0) {
+			m_pending -= std::min((unsigned)res, m_pending);
+			return;
+		}
+		if (errno != EINTR)
+			throw std::runtime_error("Failed to submit io_uring requests");
+	}
+}
+
+bool Ring::Complete(uint64_t &data, int &res) {
+	unsigned head = *m_cq_head;
+	if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+		return false;
+	const struct io_uring_cqe *cqe = &m_cqes[head & m_cq_mask];
+	data = cqe->user_data;
+	res = cqe->res;
+	__atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+} // end of uring namespace
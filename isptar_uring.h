@@ -0,0 +1,51 @@
+#ifndef __ISPTAR_URING_H__
+#define __ISPTAR_URING_H__
+#include <sys/uio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/**
+ * Минимальная обертка io_uring на системных вызовах (без liburing): только
+ * чтение в iovec. Владелец один поток, заявки и завершения без блокировок
+ */
+namespace uring {
+class Ring {
+public:
+	/// исключение, если ядро не дает io_uring
+	Ring(unsigned entries);
+	~Ring();
+
+	/// поставить чтение в очередь, false если она полна. iov нужен до завершения
+	bool Read(int fd, const struct iovec *iov, uint64_t offset, uint64_t data);
+	/// отправить поставленное и дождаться wait завершений
+	void Submit(unsigned wait);
+	/// очередное завершение: data заявки и результат read(2) или -errno
+	bool Complete(uint64_t &data, int &res);
+
+private:
+	int m_fd;
+	void *m_sq;
+	size_t m_sq_size;
+	void *m_cq;
+	size_t m_cq_size;
+	struct io_uring_sqe *m_sqes;
+	size_t m_sqes_size;
+	unsigned *m_sq_head;
+	unsigned *m_sq_tail;
+	unsigned m_sq_mask;
+	unsigned m_sq_entries;
+	unsigned *m_sq_array;
+	unsigned *m_cq_head;
+	unsigned *m_cq_tail;
+	unsigned m_cq_mask;
+	struct io_uring_cqe *m_cqes;
+	unsigned m_pending;
+
+	void Close();
+};
+} // end of uring namespace
+
+#endif
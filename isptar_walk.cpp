@@ -0,0 +1,243 @@
+#include "isptar_walk.h"
+#include "isptar_file.h"
+#include "isptar_misc.h"
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+#define	WALK_BUFFER	(64 * 1024)
+
+namespace walk {
+enum State { QUEUED, SCANNING, DONE };
+
+/// inode каталога и его предков: каталог, совпавший с предком, - цикл
+struct Chain {
+	ino_t ino;
+	std::shared_ptr<const Chain> up;
+};
+
+struct Walker::Entry {
+	string name;
+	struct stat sb;
+	/// каталог, в который можно зайти
+	DirPtr dir;
+};
+
+struct Walker::Dir {
+	/// без '/' в конце
+	string path;
+	std::shared_ptr<const Chain> chain;
+	bool prefetch;
+	State state;
+	bool cancelled;
+	/// записи учтены в m_ahead
+	bool counted;
+	std::vector<Entry> entries;
+	/// дальше поля только потока Read
+	bool ready;
+	size_t pos;
+
+	Dir(const string &_path, ino_t ino, const std::shared_ptr<const Chain> &up, bool _prefetch)
+		: path(_path)
+		, chain(new Chain{ino, up})
+		, prefetch(_prefetch)
+		, state(QUEUED)
+		, cancelled(false)
+		, counted(false)
+		, ready(false)
+		, pos(0) {}
+};
+
+Walker::Walker(const string &root, int threads, const Filter &prefetch)
+	: m_prefetch(prefetch)
+	, m_dev(0)
+	, m_entry(NULL)
+	, m_descend(false)
+	, m_ahead(0)
+	, m_stop(false) {
+	struct stat sb;
+	if (::stat(root.c_str(), &sb) || !S_ISDIR(sb.st_mode))
+		return;
+	m_dev = sb.st_dev;
+	string path = root;
+	if (!path.empty() && path[path.size() - 1] == '/')
+		path.resize(path.size() - 1);
+	m_path.push_back(DirPtr(new Dir(path, sb.st_ino, NULL, true)));
+	if (threads <= 0)
+		return;
+	m_queue.push_back(m_path.back());
+	for (int i = 0; i < threads; ++i)
+		m_threads.push_back(std::thread(&Walker::Run, this));
+}
+
+Walker::~Walker() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_cond.notify_all();
+	ForEachI(m_threads, th)
+		th->join();
+}
+
+bool Walker::Read() {
+	if (m_descend) {
+		m_path.push_back(m_entry->dir);
+		m_descend = false;
+	}
+	while (!m_path.empty()) {
+		Dir &dir = *m_path.back();
+		if (!dir.ready) {
+			Wait(m_path.back());
+			dir.ready = true;
+		}
+		if (dir.pos < dir.entries.size()) {
+			m_entry = &dir.entries[dir.pos++];
+			m_name = dir.path + '/' + m_entry->name;
+			m_descend = (bool)m_entry->dir;
+			return true;
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (dir.counted)
+				m_ahead -= dir.entries.size();
+			dir.counted = false;
+			std::vector<Entry>().swap(dir.entries);
+		}
+		m_cond.notify_all();
+		m_path.pop_back();
+		// пройденный каталог держит только запись родителя
+		if (!m_path.empty())
+			m_path.back()->entries[m_path.back()->pos - 1].dir.reset();
+	}
+	m_entry = NULL;
+	return false;
+}
+
+void Walker::Skip() {
+	if (!m_descend)
+		return;
+	m_descend = false;
+	Dir &parent = *m_path.back();
+	DirPtr dir;
+	dir.swap(parent.entries[parent.pos - 1].dir);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Release(*dir);
+	}
+	m_cond.notify_all();
+}
+
+const string & Walker::RealPath() const { return m_name; }
+
+const struct stat & Walker::stat() const { return m_entry->sb; }
+
+bool Walker::IsDir() const { return S_ISDIR(m_entry->sb.st_mode); }
+
+void Walker::Run() {
+	while (true) {
+		DirPtr dir;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cond.wait(lock, [this] { return m_stop || (!m_queue.empty() && m_ahead < WALK_AHEAD); });
+			if (m_stop)
+				return;
+			dir = m_queue.back();
+			m_queue.pop_back();
+			if (dir->state != QUEUED || dir->cancelled)
+				continue;
+			dir->state = SCANNING;
+		}
+		Scan(*dir);
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			Done(dir);
+		}
+		m_cond.notify_all();
+	}
+}
+
+void Walker::Scan(Dir &dir) {
+	misc::ResHandle fd = open(dir.path.empty() ? "/" : dir.path.c_str(), O_RDONLY|O_DIRECTORY|O_LARGEFILE|O_CLOEXEC);
+	if (!fd)
+		return;
+	std::vector<char> buf(WALK_BUFFER);
+	long size;
+	while ((size = syscall(SYS_getdents64, (int)fd, &buf[0], buf.size())) > 0) {
+		for (long pos = 0; pos < size; ) {
+			const struct dirent64 *ent = (const struct dirent64 *)&buf[pos];
+			pos += ent->d_reclen;
+			if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+				continue;
+			Entry entry;
+			entry.name = ent->d_name;
+			if (fstatat(fd, ent->d_name, &entry.sb, AT_SYMLINK_NOFOLLOW))
+				continue;
+			// как FTS_XDEV и FTS_DC у DirTree: точка монтирования выдается,
+			// но внутрь не заходим, цикл пропускается совсем
+			if (S_ISDIR(entry.sb.st_mode) && entry.sb.st_dev == m_dev) {
+				bool cycle = false;
+				for (auto up = dir.chain; up && !cycle; up = up->up)
+					cycle = up->ino == entry.sb.st_ino;
+				if (cycle)
+					continue;
+				const string path = dir.path + '/' + entry.name;
+				entry.dir.reset(new Dir(path, entry.sb.st_ino, dir.chain, !m_prefetch || m_prefetch(path)));
+			}
+			dir.entries.push_back(std::move(entry));
+		}
+	}
+	std::sort(dir.entries.begin(), dir.entries.end(), [](const Entry &a, const Entry &b) {
+		return file::DirTree::AlphaSort(a.name.c_str(), b.name.c_str()) < 0;
+	});
+}
+
+/// под m_mutex
+void Walker::Done(const DirPtr &dir) {
+	dir->state = DONE;
+	if (dir->cancelled) {
+		std::vector<Entry>().swap(dir->entries);
+		return;
+	}
+	dir->counted = true;
+	m_ahead += dir->entries.size();
+	if (m_threads.empty())
+		return;
+	// стек: первым будет прочитан первый подкаталог, как и понадобится Read
+	for (auto entry = dir->entries.rbegin(); entry != dir->entries.rend(); ++entry)
+		if (entry->dir && entry->dir->prefetch)
+			m_queue.push_back(entry->dir);
+}
+
+void Walker::Wait(const DirPtr &dir) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (dir->state != DONE) {
+		if (dir->state == SCANNING) {
+			m_cond.wait(lock);
+			continue;
+		}
+		dir->state = SCANNING;
+		lock.unlock();
+		Scan(*dir);
+		lock.lock();
+		Done(dir);
+		m_cond.notify_all();
+	}
+}
+
+/// под m_mutex: каталог и все, что в нем прочитано, больше не нужны
+void Walker::Release(Dir &dir) {
+	dir.cancelled = true;
+	if (dir.state != DONE)
+		return;
+	if (dir.counted)
+		m_ahead -= dir.entries.size();
+	dir.counted = false;
+	ForEachI(dir.entries, entry)
+		if (entry->dir)
+			Release(*entry->dir);
+	std::vector<Entry>().swap(dir.entries);
+}
+} // end of walk namespace
@@ -0,0 +1,70 @@
+#ifndef __ISPTAR_WALK_H__
+#define __ISPTAR_WALK_H__
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+/// сколько прочитанных заранее записей каталогов может ждать Read
+#define	WALK_AHEAD	(256 * 1024)
+
+/**
+ * Обход дерева каталогов в том же порядке, что и file::DirTree: каталог,
+ * затем его содержимое по DirTree::AlphaSort. Корень не выдается, каталоги
+ * на других файловых системах выдаются без содержимого, циклы пропускаются.
+ * Каталоги читаются getdents64 и fstatat в нескольких потоках с опережением
+ * до WALK_AHEAD записей, а Read отдает их по порядку. Каталог, до которого
+ * потоки не добрались, Read читает сам, так что при threads = 0 обход
+ * идет как обычно в одном потоке
+ */
+namespace walk {
+using std::string;
+
+class Walker {
+public:
+	typedef std::function<bool(const string &)> Filter;
+
+	/// prefetch(path) == false - каталог читается только когда до него дойдет Read
+	Walker(const string &root, int threads, const Filter &prefetch);
+	~Walker();
+
+	bool Read();
+	/// не заходить в текущий каталог
+	void Skip();
+
+	const string & RealPath() const;
+	/// lstat текущей записи
+	const struct stat & stat() const;
+	bool IsDir() const;
+
+private:
+	struct Dir;
+	struct Entry;
+	typedef std::shared_ptr<Dir> DirPtr;
+
+	const Filter m_prefetch;
+	dev_t m_dev;
+	std::vector<DirPtr> m_path;
+	const Entry *m_entry;
+	string m_name;
+	bool m_descend;
+
+	std::vector<std::thread> m_threads;
+	std::vector<DirPtr> m_queue;
+	int64_t m_ahead;
+	bool m_stop;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+
+	void Run();
+	void Scan(Dir &dir);
+	void Done(const DirPtr &dir);
+	void Wait(const DirPtr &dir);
+	void Release(Dir &dir);
+};
+} // end of walk namespace
+
+#endif
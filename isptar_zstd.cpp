@@ -0,0 +1,119 @@
+#include "isptar_zstd.h"
+#include <stdexcept>
+
+namespace zstd {
+static size_t Check(size_t res, const char *what) {
+	if (ZSTD_isError(res))
+		throw std::runtime_error(std::string(what) + ": " + ZSTD_getErrorName(res));
+	return res;
+}
+
+IStream::IStream(io::IStream &in, int64_t limit)
+	: m_in(in)
+	, m_limit(limit)
+	, m_ctx(ZSTD_createDCtx())
+	, m_end(false) {
+	if (!m_ctx)
+		throw std::runtime_error("Failed to init zstd");
+	m_input.src = m_buf;
+	m_input.size = 0;
+	m_input.pos = 0;
+}
+
+IStream::~IStream() { ZSTD_freeDCtx(m_ctx); }
+
+void IStream::Reset(int64_t limit) {
+	m_limit = limit;
+	m_input.size = 0;
+	m_input.pos = 0;
+	m_end = false;
+	Check(ZSTD_DCtx_reset(m_ctx, ZSTD_reset_session_only), "Failed to reset zstd state");
+}
+
+int64_t IStream::Read(char *buf, int64_t size) {
+	ZSTD_outBuffer output = { buf, (size_t)size, 0 };
+	while (!m_end && output.pos < output.size) {
+		if (m_input.pos == m_input.size) {
+			int len = m_limit == -1 || m_limit > (int64_t)sizeof(m_buf)
+				? sizeof(m_buf)
+				: m_limit;
+			int64_t have = m_in.Read(m_buf, len);
+			if (have == -1)
+				throw std::runtime_error("Failed to get input");
+			if (have == 0)
+				break;
+			if (m_limit != -1)
+				m_limit -= have;
+			m_input.size = have;
+			m_input.pos = 0;
+		}
+		// 0 означает конец frame, следующий файл в нем уже не читаем
+		m_end = Check(ZSTD_decompressStream(m_ctx, &output, &m_input), "Failed to extract") == 0;
+	}
+	return output.pos;
+}
+
+OStream::OStream(io::OStream &out, int level, int threads)
+	: m_out(out)
+	, m_ctx(ZSTD_createCCtx())
+	, m_offset(0)
+	, m_total_out(0)
+	, m_empty(true) {
+	if (!m_ctx)
+		throw std::runtime_error("Failed to init zstd");
+	SetLevel(level);
+	// libzstd без поддержки потоков не принимает nbWorkers: сжимаем в вызывающем потоке
+	if (threads > 0 && ZSTD_isError(ZSTD_CCtx_setParameter(m_ctx, ZSTD_c_nbWorkers, threads)))
+		Check(ZSTD_CCtx_setParameter(m_ctx, ZSTD_c_nbWorkers, 0), "Failed to set zstd workers");
+}
+
+OStream::~OStream() { ZSTD_freeCCtx(m_ctx); }
+
+void OStream::Write(const char *buf, int64_t size) {
+	m_total_out += size;
+	Pack(buf, size, ZSTD_e_continue);
+}
+
+int64_t OStream::Offset() {
+	Flush(false);
+	return m_offset;
+}
+
+void OStream::Flush(bool finish) {
+	if (finish) {
+		Pack(NULL, 0, ZSTD_e_end);
+		m_offset = 0;
+	} else {
+		Pack(NULL, 0, ZSTD_e_flush);
+	}
+}
+
+void OStream::SetLevel(int level) {
+	Flush(true);
+	// у zstd нет режима без сжатия, минимальный уровень почти бесплатен
+	Check(ZSTD_CCtx_setParameter(m_ctx, ZSTD_c_compressionLevel, level ? level : ZSTD_minCLevel()),
+		"Failed to set compressing level");
+}
+
+int64_t OStream::TotalOut() const { return m_total_out; }
+
+void OStream::Pack(const char *in, int64_t size, ZSTD_EndDirective mode) {
+	if (size == 0) {
+		if (m_empty)
+			return;
+		m_empty = true;
+	} else
+		m_empty = false;
+
+	ZSTD_inBuffer input = { in, (size_t)size, 0 };
+	char buf[CHUNK * 4];
+	size_t left;
+	do {
+		ZSTD_outBuffer output = { buf, sizeof(buf), 0 };
+		left = Check(ZSTD_compressStream2(m_ctx, &output, &input, mode), "Failed to compress");
+		if (output.pos)
+			m_out.Write(buf, output.pos);
+		m_offset += output.pos;
+	} while (mode == ZSTD_e_continue ? input.pos < input.size : left != 0);
+}
+} // end of zstd namespace
@@ -0,0 +1,44 @@
+#ifndef __ISPTAR_ZSTD_H__
+#define __ISPTAR_ZSTD_H__
+#include <zstd.h>
+#include "isptar_codec.h"
+
+namespace zstd {
+class IStream : public codec::IStream {
+public:
+	IStream(io::IStream &in, int64_t limit = -1);
+	~IStream();
+	virtual void Reset(int64_t limit = -1);
+
+	virtual int64_t Read(char *buf, int64_t size);
+private:
+	io::IStream &m_in;
+	int64_t m_limit;
+	ZSTD_DCtx *m_ctx;
+	ZSTD_inBuffer m_input;
+	bool m_end;
+	char m_buf[CHUNK];
+};
+
+class OStream : public codec::OStream {
+public:
+	OStream(io::OStream &out, int level, int threads = 0);
+	~OStream();
+	virtual void Write(const char *buf, int64_t size);
+	virtual int64_t Offset();
+
+	virtual void Flush(bool finish);
+	virtual void SetLevel(int level);
+	virtual int64_t TotalOut() const;
+private:
+	io::OStream &m_out;
+	ZSTD_CCtx *m_ctx;
+	int64_t m_offset;
+	int64_t m_total_out;
+	bool m_empty;
+
+	void Pack(const char *buf, int64_t size, ZSTD_EndDirective mode);
+};
+} // end of zstd namespace
+
+#endif